@@ -2,18 +2,54 @@
 #include <cmath>
 #include <vector>
 #include <string>
+#include <algorithm>
 #include <portaudio.h>
 #include <SDL2/SDL.h>
-#include <mutex>
+#include <cstring>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <atomic>
+#include <cstdint>
+#include <complex>
+#include <memory>
+#include <chrono>
+#include <cstdio>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <unistd.h>
+#include <strings.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <cerrno>
+
+#ifdef WAVE_HAVE_ALSA
+#include <alsa/asoundlib.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define WAVE_SIMD_SSE2 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define WAVE_SIMD_NEON 1
+#endif
 
 // Audio parameters
-#define SAMPLE_RATE 44100
-#define FRAMES_PER_BUFFER 256
+#define DEFAULT_SAMPLE_RATE 44100
+#define DEFAULT_FRAMES_PER_BUFFER 64
+#define OSC_BLOCK_FRAMES 256   // Oscillator renders in blocks of at most this many frames
+#define SCOPE_RATE 11025       // Scope samples per second, whatever the audio rate
+#define DEFAULT_FREQUENCY_SMOOTHING 0.02f // Seconds for a knob change to take full effect
+#define DEFAULT_PHASE_SMOOTHING 0.02f
+#define DEFAULT_AMPLITUDE_SMOOTHING 0.01f
+#define MAX_VOICES 256
 
 // Visual parameters
 #define WINDOW_WIDTH 1000
@@ -21,6 +57,237 @@
 #define WAVE_SAMPLES 800
 #define KNOB_RADIUS 30
 #define KNOB_PANEL_HEIGHT 120
+#define KNOB_SPRITE_EXTENT (KNOB_RADIUS + 1) // Half the sprite's size, with room for the antialiased edge
+
+// Fraction of a pixel inside an edge at signed distance (positive inside),
+// pixel being the size of one output pixel in window coordinates
+static inline float edgeCoverage(float inside, float pixel) {
+    return std::max(0.0f, std::min(1.0f, inside / pixel + 0.5f));
+}
+
+// Rasterizes a sprite covering extent window coordinates either side of its
+// centre at scale output pixels per coordinate. shade(x, y, r, g, b) returns
+// the coverage at a pixel centre, given relative to the sprite's centre, and
+// sets its colour.
+template<typename Shade>
+static SDL_Texture* rasterizeSprite(SDL_Renderer* renderer, float scale, float extent, Shade shade) {
+    int size = (int)ceilf(2 * extent * scale);
+    std::vector<uint32_t> pixels((size_t)size * size);
+    for(int row = 0; row < size; row++) {
+        for(int column = 0; column < size; column++) {
+            float r = 0.0f, g = 0.0f, b = 0.0f;
+            float alpha = shade((column + 0.5f) / scale - extent, (row + 0.5f) / scale - extent, r, g, b);
+            pixels[(size_t)row * size + column] = (uint32_t)lrintf(alpha * 255.0f) << 24 |
+                                                  (uint32_t)lrintf(r) << 16 | (uint32_t)lrintf(g) << 8 |
+                                                  (uint32_t)lrintf(b);
+        }
+    }
+    SDL_Texture* texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, size, size);
+    if(!texture) return nullptr;
+    SDL_UpdateTexture(texture, nullptr, pixels.data(), size * sizeof(uint32_t));
+    SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+#if SDL_VERSION_ATLEAST(2, 0, 12)
+    SDL_SetTextureScaleMode(texture, SDL_ScaleModeLinear); // Smooth rotation
+#endif
+    return texture;
+}
+
+// Knob artwork, rasterized once into textures at the display's pixel density
+// and drawn with two copies per knob: the base with its outline, then the
+// indicator rotated into place. Rebuilt when the density changes or the
+// renderer loses its textures.
+struct KnobSprites {
+    SDL_Texture* base;
+    SDL_Texture* indicator;
+    float scale;    // Output pixels per window coordinate the textures were built for
+    
+    KnobSprites() : base(nullptr), indicator(nullptr), scale(0.0f) {}
+    ~KnobSprites() { release(); }
+    
+    void release() {
+        if(base) SDL_DestroyTexture(base);
+        if(indicator) SDL_DestroyTexture(indicator);
+        base = nullptr;
+        indicator = nullptr;
+    }
+    
+    bool prepare(SDL_Renderer* renderer, float pixelScale) {
+        if(base && indicator && pixelScale == scale) return true;
+        release();
+        scale = pixelScale;
+        const float pixel = 1.0f / scale;
+        base = rasterizeSprite(renderer, scale, KNOB_SPRITE_EXTENT,
+                               [&](float x, float y, float& r, float& g, float& b) {
+            float distance = sqrtf(x * x + y * y);
+            float disc = edgeCoverage(KNOB_RADIUS - distance, pixel);
+            float ring = edgeCoverage(0.5f - fabsf(distance - (KNOB_RADIUS - 0.5f)), pixel);
+            float alpha = ring + disc * (1.0f - ring);
+            if(alpha > 0.0f) {
+                r = g = b = (200.0f * ring + 60.0f * disc * (1.0f - ring)) / alpha;
+            }
+            return alpha;
+        });
+        // Pointing along +x; drawing rotates it to the knob's angle
+        indicator = rasterizeSprite(renderer, scale, KNOB_SPRITE_EXTENT,
+                                    [&](float x, float y, float& r, float& g, float& b) {
+            float dx = x - (KNOB_RADIUS - 8), distance = sqrtf(dx * dx + y * y);
+            r = 255.0f;
+            g = b = 100.0f;
+            return edgeCoverage(4.0f - distance, pixel);
+        });
+        return base && indicator;
+    }
+};
+
+// Text from a baked 5x7 bitmap font. The glyphs are rasterized once into an
+// atlas texture at the output density; strings are laid out into TextRuns of
+// textured quads, and all the text on screen goes out in one
+// SDL_RenderGeometry call per frame.
+#define FONT_FIRST_CHAR 32
+#define FONT_CHAR_COUNT 95
+#define FONT_GLYPH_WIDTH 5
+#define FONT_GLYPH_HEIGHT 7
+#define FONT_ADVANCE 6        // Window coordinates per character, and the atlas cell width
+#define FONT_CELL_HEIGHT 8
+
+// Printable ASCII, one byte per column with bit 0 at the top
+static const uint8_t font5x7[FONT_CHAR_COUNT][FONT_GLYPH_WIDTH] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00}, {0x00, 0x00, 0x5F, 0x00, 0x00}, {0x00, 0x07, 0x00, 0x07, 0x00}, {0x14, 0x7F, 0x14, 0x7F, 0x14},
+    {0x24, 0x2A, 0x7F, 0x2A, 0x12}, {0x23, 0x13, 0x08, 0x64, 0x62}, {0x36, 0x49, 0x56, 0x20, 0x50}, {0x00, 0x05, 0x03, 0x00, 0x00},
+    {0x00, 0x1C, 0x22, 0x41, 0x00}, {0x00, 0x41, 0x22, 0x1C, 0x00}, {0x14, 0x08, 0x3E, 0x08, 0x14}, {0x08, 0x08, 0x3E, 0x08, 0x08},
+    {0x00, 0x50, 0x30, 0x00, 0x00}, {0x08, 0x08, 0x08, 0x08, 0x08}, {0x00, 0x60, 0x60, 0x00, 0x00}, {0x20, 0x10, 0x08, 0x04, 0x02},
+    {0x3E, 0x51, 0x49, 0x45, 0x3E}, {0x00, 0x42, 0x7F, 0x40, 0x00}, {0x42, 0x61, 0x51, 0x49, 0x46}, {0x21, 0x41, 0x45, 0x4B, 0x31},
+    {0x18, 0x14, 0x12, 0x7F, 0x10}, {0x27, 0x45, 0x45, 0x45, 0x39}, {0x3C, 0x4A, 0x49, 0x49, 0x30}, {0x01, 0x71, 0x09, 0x05, 0x03},
+    {0x36, 0x49, 0x49, 0x49, 0x36}, {0x06, 0x49, 0x49, 0x29, 0x1E}, {0x00, 0x36, 0x36, 0x00, 0x00}, {0x00, 0x56, 0x36, 0x00, 0x00},
+    {0x08, 0x14, 0x22, 0x41, 0x00}, {0x14, 0x14, 0x14, 0x14, 0x14}, {0x00, 0x41, 0x22, 0x14, 0x08}, {0x02, 0x01, 0x51, 0x09, 0x06},
+    {0x32, 0x49, 0x79, 0x41, 0x3E}, {0x7E, 0x11, 0x11, 0x11, 0x7E}, {0x7F, 0x49, 0x49, 0x49, 0x36}, {0x3E, 0x41, 0x41, 0x41, 0x22},
+    {0x7F, 0x41, 0x41, 0x22, 0x1C}, {0x7F, 0x49, 0x49, 0x49, 0x41}, {0x7F, 0x09, 0x09, 0x09, 0x01}, {0x3E, 0x41, 0x49, 0x49, 0x7A},
+    {0x7F, 0x08, 0x08, 0x08, 0x7F}, {0x00, 0x41, 0x7F, 0x41, 0x00}, {0x20, 0x40, 0x41, 0x3F, 0x01}, {0x7F, 0x08, 0x14, 0x22, 0x41},
+    {0x7F, 0x40, 0x40, 0x40, 0x40}, {0x7F, 0x02, 0x0C, 0x02, 0x7F}, {0x7F, 0x04, 0x08, 0x10, 0x7F}, {0x3E, 0x41, 0x41, 0x41, 0x3E},
+    {0x7F, 0x09, 0x09, 0x09, 0x06}, {0x3E, 0x41, 0x51, 0x21, 0x5E}, {0x7F, 0x09, 0x19, 0x29, 0x46}, {0x46, 0x49, 0x49, 0x49, 0x31},
+    {0x01, 0x01, 0x7F, 0x01, 0x01}, {0x3F, 0x40, 0x40, 0x40, 0x3F}, {0x1F, 0x20, 0x40, 0x20, 0x1F}, {0x3F, 0x40, 0x38, 0x40, 0x3F},
+    {0x63, 0x14, 0x08, 0x14, 0x63}, {0x07, 0x08, 0x70, 0x08, 0x07}, {0x61, 0x51, 0x49, 0x45, 0x43}, {0x00, 0x7F, 0x41, 0x41, 0x00},
+    {0x02, 0x04, 0x08, 0x10, 0x20}, {0x00, 0x41, 0x41, 0x7F, 0x00}, {0x04, 0x02, 0x01, 0x02, 0x04}, {0x40, 0x40, 0x40, 0x40, 0x40},
+    {0x00, 0x01, 0x02, 0x04, 0x00}, {0x20, 0x54, 0x54, 0x54, 0x78}, {0x7F, 0x48, 0x44, 0x44, 0x38}, {0x38, 0x44, 0x44, 0x44, 0x20},
+    {0x38, 0x44, 0x44, 0x48, 0x7F}, {0x38, 0x54, 0x54, 0x54, 0x18}, {0x08, 0x7E, 0x09, 0x01, 0x02}, {0x0C, 0x52, 0x52, 0x52, 0x3E},
+    {0x7F, 0x08, 0x04, 0x04, 0x78}, {0x00, 0x44, 0x7D, 0x40, 0x00}, {0x20, 0x40, 0x44, 0x3D, 0x00}, {0x7F, 0x10, 0x28, 0x44, 0x00},
+    {0x00, 0x41, 0x7F, 0x40, 0x00}, {0x7C, 0x04, 0x18, 0x04, 0x78}, {0x7C, 0x08, 0x04, 0x04, 0x78}, {0x38, 0x44, 0x44, 0x44, 0x38},
+    {0x7C, 0x14, 0x14, 0x14, 0x08}, {0x08, 0x14, 0x14, 0x18, 0x7C}, {0x7C, 0x08, 0x04, 0x04, 0x08}, {0x48, 0x54, 0x54, 0x54, 0x20},
+    {0x04, 0x3F, 0x44, 0x40, 0x20}, {0x3C, 0x40, 0x40, 0x20, 0x7C}, {0x1C, 0x20, 0x40, 0x20, 0x1C}, {0x3C, 0x40, 0x30, 0x40, 0x3C},
+    {0x44, 0x28, 0x10, 0x28, 0x44}, {0x0C, 0x50, 0x50, 0x50, 0x3C}, {0x44, 0x64, 0x54, 0x4C, 0x44}, {0x00, 0x08, 0x36, 0x41, 0x00},
+    {0x00, 0x00, 0x7F, 0x00, 0x00}, {0x00, 0x41, 0x36, 0x08, 0x00}, {0x10, 0x08, 0x08, 0x10, 0x08},
+};
+
+// One glyph's screen position and atlas columns. Kept apart from SDL_Vertex,
+// which only exists from SDL 2.0.18 on.
+struct GlyphQuad {
+    float x, y;   // Top left, logical pixels
+    float u0, u1; // Atlas columns, normalized
+    SDL_Color color;
+};
+
+// One string's quads, laid out once and reused until the string changes
+struct TextRun {
+    std::vector<GlyphQuad> quads; // One per visible character
+    
+    static float width(const std::string& text) { return (float)text.size() * FONT_ADVANCE; }
+    
+    void layout(const std::string& text, float x, float y, SDL_Color color) {
+        const float atlasWidth = (float)FONT_CHAR_COUNT * FONT_ADVANCE;
+        quads.clear();
+        for(size_t i = 0; i < text.size(); i++, x += FONT_ADVANCE) {
+            int glyph = (unsigned char)text[i] - FONT_FIRST_CHAR;
+            if(glyph < 0 || glyph >= FONT_CHAR_COUNT) glyph = '?' - FONT_FIRST_CHAR;
+            if(glyph == 0) continue; // Space
+            float u0 = glyph * FONT_ADVANCE / atlasWidth, u1 = (glyph * FONT_ADVANCE + FONT_GLYPH_WIDTH) / atlasWidth;
+            quads.push_back({x, y, u0, u1, color});
+        }
+    }
+};
+
+// The atlas and the frame's text, collected from TextRuns and drawn at once
+struct TextBatch {
+    SDL_Texture* atlas;
+    int atlasWidth, atlasHeight; // Pixels
+    float scale;
+    std::vector<GlyphQuad> quads;
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+    std::vector<SDL_Vertex> vertices;
+    std::vector<int> indices;
+#endif
+    
+    TextBatch() : atlas(nullptr), atlasWidth(0), atlasHeight(0), scale(0.0f) {}
+    ~TextBatch() { release(); }
+    
+    void release() {
+        if(atlas) SDL_DestroyTexture(atlas);
+        atlas = nullptr;
+    }
+    
+    bool prepare(SDL_Renderer* renderer, float pixelScale) {
+        if(atlas && pixelScale == scale) return true;
+        release();
+        scale = pixelScale;
+        atlasWidth = (int)ceilf(FONT_CHAR_COUNT * FONT_ADVANCE * scale);
+        atlasHeight = (int)ceilf(FONT_CELL_HEIGHT * scale);
+        // White glyphs; the vertex colour tints them
+        std::vector<uint32_t> pixels((size_t)atlasWidth * atlasHeight, 0);
+        for(int row = 0; row < atlasHeight; row++) {
+            int fontRow = (int)((row + 0.5f) / scale);
+            if(fontRow >= FONT_GLYPH_HEIGHT) continue;
+            for(int column = 0; column < atlasWidth; column++) {
+                int unit = (int)((column + 0.5f) / scale);
+                int glyph = unit / FONT_ADVANCE, fontColumn = unit % FONT_ADVANCE;
+                if(glyph < FONT_CHAR_COUNT && fontColumn < FONT_GLYPH_WIDTH && (font5x7[glyph][fontColumn] >> fontRow & 1)) {
+                    pixels[(size_t)row * atlasWidth + column] = 0xFFFFFFFFu;
+                }
+            }
+        }
+        atlas = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, atlasWidth, atlasHeight);
+        if(!atlas) return false;
+        SDL_UpdateTexture(atlas, nullptr, pixels.data(), atlasWidth * sizeof(uint32_t));
+        SDL_SetTextureBlendMode(atlas, SDL_BLENDMODE_BLEND);
+        return true;
+    }
+    
+    void add(const TextRun& run) {
+        quads.insert(quads.end(), run.quads.begin(), run.quads.end());
+    }
+    
+    void submit(SDL_Renderer* renderer) {
+        if(atlas && !quads.empty()) {
+            const float v1 = (float)FONT_GLYPH_HEIGHT / FONT_CELL_HEIGHT;
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+            // Four vertices and two triangles per quad; the indices only ever grow
+            vertices.clear();
+            for(const GlyphQuad& quad : quads) {
+                float right = quad.x + FONT_GLYPH_WIDTH, bottom = quad.y + FONT_GLYPH_HEIGHT;
+                vertices.push_back({{quad.x, quad.y}, quad.color, {quad.u0, 0.0f}});
+                vertices.push_back({{right, quad.y}, quad.color, {quad.u1, 0.0f}});
+                vertices.push_back({{quad.x, bottom}, quad.color, {quad.u0, v1}});
+                vertices.push_back({{right, bottom}, quad.color, {quad.u1, v1}});
+            }
+            for(int quad = (int)indices.size() / 6; quad < (int)quads.size(); quad++) {
+                int first = quad * 4;
+                int triangles[6] = {first, first + 1, first + 2, first + 2, first + 1, first + 3};
+                indices.insert(indices.end(), triangles, triangles + 6);
+            }
+            SDL_RenderGeometry(renderer, atlas, vertices.data(), (int)vertices.size(), indices.data(),
+                               (int)quads.size() * 6);
+#else
+            // One copy per glyph without SDL_RenderGeometry
+            for(const GlyphQuad& quad : quads) {
+                SDL_Rect source = {(int)lrintf(quad.u0 * atlasWidth), 0,
+                                   (int)lrintf((quad.u1 - quad.u0) * atlasWidth), (int)lrintf(v1 * atlasHeight)};
+                SDL_Rect dest = {(int)quad.x, (int)quad.y, FONT_GLYPH_WIDTH, FONT_GLYPH_HEIGHT};
+                SDL_SetTextureColorMod(atlas, quad.color.r, quad.color.g, quad.color.b);
+                SDL_RenderCopy(renderer, atlas, &source, &dest);
+            }
+#endif
+        }
+        quads.clear();
+    }
+};
 
 struct Knob {
     float x, y;
@@ -30,10 +297,15 @@ struct Knob {
     bool isDragging;
     float dragStartY;
     float dragStartValue;
+    TextRun labelText;
+    TextRun valueText;
+    float shownValue;     // Value valueText was laid out for
     
     Knob(float x, float y, float min, float max, float initial, const std::string& label) 
         : x(x), y(y), minValue(min), maxValue(max), value(initial), label(label),
-          isDragging(false), dragStartY(0), dragStartValue(0) {}
+          isDragging(false), dragStartY(0), dragStartValue(0), shownValue(NAN) {
+        labelText.layout(label, x - TextRun::width(label) / 2, y + KNOB_RADIUS + 10, {255, 255, 255, 255});
+    }
     
     void update(int mouseX, int mouseY, bool mouseDown) {
         float dx = mouseX - x;
@@ -58,161 +330,3241 @@ struct Knob {
         }
     }
     
-    void draw(SDL_Renderer* renderer) {
-        // Draw knob base (dark circle)
-        drawCircle(renderer, x, y, KNOB_RADIUS, 60, 60, 60);
-        
-        // Draw knob value indicator (bright circle)
-        float angle = (value - minValue) / (maxValue - minValue) * 2 * M_PI * 0.8f - 0.8f * M_PI; // 288 degrees range
-        int indicatorX = x + (KNOB_RADIUS - 8) * cos(angle);
-        int indicatorY = y + (KNOB_RADIUS - 8) * sin(angle);
-        drawCircle(renderer, indicatorX, indicatorY, 4, 255, 100, 100);
-        
-        // Draw border
-        drawCircleOutline(renderer, x, y, KNOB_RADIUS, 200, 200, 200);
-        
-        // Draw label (simple text using lines)
-        drawText(renderer, x - 25, y + KNOB_RADIUS + 10, label);
-        
-        // Draw value
-        char valueStr[20];
-        if (maxValue > 100) {
-            snprintf(valueStr, sizeof(valueStr), "%.0f", value);
-        } else {
-            snprintf(valueStr, sizeof(valueStr), "%.2f", value);
+    void draw(SDL_Renderer* renderer, const KnobSprites& sprites, TextBatch& text) {
+        // Draw knob base with its border
+        SDL_Rect rect = {(int)x - KNOB_SPRITE_EXTENT, (int)y - KNOB_SPRITE_EXTENT,
+                         2 * KNOB_SPRITE_EXTENT, 2 * KNOB_SPRITE_EXTENT};
+        SDL_RenderCopy(renderer, sprites.base, nullptr, &rect);
+        
+        // Draw knob value indicator (bright circle), rotated around the centre
+        float angle = (value - minValue) / (maxValue - minValue) * 2 * M_PI * 0.8f - 0.8f * M_PI; // 288 degrees range
+        SDL_RenderCopyEx(renderer, sprites.indicator, nullptr, &rect, angle * 180.0 / M_PI, nullptr, SDL_FLIP_NONE);
+        
+        // Draw label, laid out once
+        text.add(labelText);
+        
+        // Draw value, laid out again only when it changes
+        if (value != shownValue) {
+            char valueStr[20];
+            if (maxValue > 100) {
+                snprintf(valueStr, sizeof(valueStr), "%.0f", value);
+            } else {
+                snprintf(valueStr, sizeof(valueStr), "%.2f", value);
+            }
+            valueText.layout(valueStr, x - TextRun::width(valueStr) / 2, y + KNOB_RADIUS + 25, {255, 200, 200, 255});
+            shownValue = value;
+        }
+        text.add(valueText);
+    }
+};
+
+enum Waveform { WAVE_SAW, WAVE_SQUARE, WAVE_TRIANGLE, WAVE_COUNT };
+enum OscMode { OSC_NAIVE, OSC_WAVETABLE, OSC_POLYBLEP, OSC_MODE_COUNT };
+
+static const char* const waveformNames[WAVE_COUNT] = {"saw", "square", "triangle"};
+static const char* const oscModeNames[OSC_MODE_COUNT] = {"naive", "wavetable", "polyblep"};
+
+// Oscillator parameters as seen by the audio callback
+struct SawtoothParams {
+    float frequency;
+    float phaseOffset;
+    float amplitude;
+    int waveform;
+    int mode;
+};
+
+// Smoothing for one parameter, advanced a block at a time. A new target
+// starts a ramp lasting 'seconds'; linear ramps move by a fixed amount per
+// frame, exponential ones by a fixed ratio (so a frequency glide sounds even).
+// The value is only evaluated at block ends and the kernels interpolate
+// linearly in between, which keeps the per-sample work vectorisable.
+struct ParamRamp {
+    float value;    // Value at the end of the last block
+    float target;
+    float step;     // Per frame: difference, or log of the ratio when exponential
+    long remaining; // Frames left in the ramp
+    bool exponential;
+    bool geometric; // This ramp's step is a log ratio; exponential ramps through 0 step linearly
+    float seconds;
+    
+    ParamRamp(float initial, float smoothSeconds, bool exp) : value(initial), target(initial), step(0.0f),
+                                                              remaining(0), exponential(exp), geometric(false),
+                                                              seconds(smoothSeconds) {}
+    
+    void setTarget(float newTarget, double sampleRate) {
+        target = newTarget;
+        remaining = lround(seconds * sampleRate);
+        geometric = exponential && value > 0.0f && target > 0.0f;
+        if(remaining <= 0 || value == target) {
+            value = target;
+            remaining = 0;
+        } else if(geometric) {
+            step = logf(target / value) / remaining;
+        } else {
+            step = (target - value) / remaining;
+        }
+    }
+    
+    // Value after another 'frames' frames
+    float advance(unsigned long frames) {
+        if(remaining <= (long)frames) {
+            value = target;
+            remaining = 0;
+        } else {
+            value = geometric ? value * expf(step * frames) : value + step * frames;
+            remaining -= frames;
+        }
+        return value;
+    }
+};
+
+// Triple-buffered scope frame. The audio callback appends decimated samples to
+// its own rolling history and publishes a linearised copy after each block;
+// drawWaveform swaps in the newest published frame. Neither side ever waits.
+struct ScopeBuffer {
+    static const uint8_t FRESH = 0x4; // Set in middle when the UI hasn't seen it yet
+    
+    float frames[3][WAVE_SAMPLES];
+    std::atomic<uint8_t> middle;
+    uint8_t back;   // Audio thread only
+    uint8_t front;  // UI thread only
+    float history[WAVE_SAMPLES];
+    int historyIndex;
+    
+    ScopeBuffer() : frames(), middle(1), back(0), front(2), history(), historyIndex(0) {}
+    
+    // Audio thread
+    void push(float sample) {
+        history[historyIndex] = sample;
+        historyIndex = (historyIndex + 1) % WAVE_SAMPLES;
+    }
+    
+    void publish() {
+        float* frame = frames[back];
+        int tail = WAVE_SAMPLES - historyIndex;
+        std::memcpy(frame, history + historyIndex, tail * sizeof(float));
+        std::memcpy(frame + tail, history, historyIndex * sizeof(float));
+        back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & ~FRESH;
+    }
+    
+    // UI thread: oldest sample first
+    const float* latest() {
+        if (middle.load(std::memory_order_relaxed) & FRESH) {
+            front = middle.exchange(front, std::memory_order_acq_rel) & ~FRESH;
+        }
+        return frames[front];
+    }
+};
+
+// Band-limited wavetables, one mipmap level per octave. Level n holds harmonics
+// 1..(1024 >> n), so it is alias-free as long as its top harmonic stays below
+// Nyquist; levelFor() picks the richest level that satisfies that for a given
+// phase increment, which makes the bank independent of the sample rate.
+#define WAVETABLE_BITS 12
+#define WAVETABLE_SIZE (1 << WAVETABLE_BITS)
+#define WAVETABLE_LEVELS 11
+#define WAVETABLE_MAX_HARMONICS 1024
+
+struct WavetableBank {
+    std::vector<float> tables; // [waveform][level][WAVETABLE_SIZE + 1 guard sample]
+    
+    void build() {
+        const int stride = WAVETABLE_SIZE + 1;
+        tables.assign((size_t)WAVE_COUNT * WAVETABLE_LEVELS * stride, 0.0f);
+        
+        std::vector<double> sine(WAVETABLE_SIZE), cosine(WAVETABLE_SIZE), sum(WAVETABLE_SIZE);
+        for(int n = 0; n < WAVETABLE_SIZE; n++) {
+            sine[n] = sin(2.0 * M_PI * n / WAVETABLE_SIZE);
+            cosine[n] = cos(2.0 * M_PI * n / WAVETABLE_SIZE);
+        }
+        
+        // Fourier series matching the naive shapes: saw = 2p - 1,
+        // square = p < 0.5 ? 1 : -1, triangle = 2|2p - 1| - 1
+        for(int waveform = 0; waveform < WAVE_COUNT; waveform++) {
+            for(int level = 0; level < WAVETABLE_LEVELS; level++) {
+                int harmonics = WAVETABLE_MAX_HARMONICS >> level;
+                std::fill(sum.begin(), sum.end(), 0.0);
+                for(int k = 1; k <= harmonics; k++) {
+                    double gain;
+                    const std::vector<double>* basis = &sine;
+                    if(waveform == WAVE_SAW) {
+                        gain = -2.0 / (M_PI * k);
+                    } else if(k % 2 == 0) {
+                        continue;
+                    } else if(waveform == WAVE_SQUARE) {
+                        gain = 4.0 / (M_PI * k);
+                    } else {
+                        gain = 8.0 / (M_PI * M_PI * k * k);
+                        basis = &cosine;
+                    }
+                    for(int n = 0; n < WAVETABLE_SIZE; n++) {
+                        sum[n] += gain * (*basis)[((size_t)k * n) & (WAVETABLE_SIZE - 1)];
+                    }
+                }
+                float* table = &tables[((size_t)waveform * WAVETABLE_LEVELS + level) * stride];
+                for(int n = 0; n < WAVETABLE_SIZE; n++) {
+                    table[n] = (float)sum[n];
+                }
+                table[WAVETABLE_SIZE] = table[0];
+            }
+        }
+    }
+    
+    const float* table(int waveform, int level) const {
+        return &tables[((size_t)waveform * WAVETABLE_LEVELS + level) * (WAVETABLE_SIZE + 1)];
+    }
+    
+    static int levelFor(uint32_t increment) {
+        int level = 0;
+        while(level < WAVETABLE_LEVELS - 1 &&
+              (uint64_t)increment * (WAVETABLE_MAX_HARMONICS >> level) >= 0x80000000u) {
+            level++;
+        }
+        return level;
+    }
+};
+
+// Oscillator phase is a 32-bit fixed-point fraction of a cycle: the full
+// uint32_t range is one period, so wrapping is free on overflow and every
+// period is exactly the same number of increments.
+#define PHASE_ONE 4294967296.0 // 2^32
+
+static uint32_t phaseIncrement(float frequency, double sampleRate) {
+    return (uint32_t)(int64_t)llround(frequency / sampleRate * PHASE_ONE);
+}
+
+static uint32_t phaseFromCycles(float cycles) {
+    return (uint32_t)(int64_t)llround(cycles * PHASE_ONE);
+}
+
+// Bounded single-producer/single-consumer queue, wait-free on both ends.
+// Capacity must be a power of two; push fails instead of blocking when full.
+template <typename T, size_t Capacity>
+struct SpscQueue {
+    T items[Capacity];
+    std::atomic<size_t> head; // Next slot to write, owned by the producer
+    std::atomic<size_t> tail; // Next slot to read, owned by the consumer
+    
+    SpscQueue() : items(), head(0), tail(0) {}
+    
+    bool push(const T& item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == Capacity) return false;
+        items[h & (Capacity - 1)] = item;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+    
+    bool pop(T& item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire)) return false;
+        item = items[t & (Capacity - 1)];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+    
+    // Consumer: the oldest item, left in the queue, or nullptr if empty
+    const T* peek() const {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire)) return nullptr;
+        return &items[t & (Capacity - 1)];
+    }
+    
+    // Consumer: remove the item peek() returned
+    void drop() {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+};
+
+// Event times are on the audio backend's clock, taken when the gesture
+// happened; 0 means "as soon as possible". The engine plays every event a
+// fixed delay after its time, so gestures keep their spacing to the sample.
+struct NoteEvent {
+    bool on;
+    int note;        // MIDI note number, also used to find the voice on release
+    float amplitude;
+    double time;
+};
+
+struct ParamEvent {
+    SawtoothParams params;
+    double time;
+};
+
+// Fixed pool of oscillator voices, laid out structure-of-arrays so the render
+// loop walks a compact list of active voices over contiguous parameter arrays.
+// Nothing here allocates; when the pool is full the oldest voice is stolen.
+struct VoicePool {
+    uint32_t phase[MAX_VOICES];
+    uint32_t increment[MAX_VOICES];
+    float gain[MAX_VOICES];       // Gain reached at the end of the last block
+    float targetGain[MAX_VOICES]; // Gain ramped to over the next block
+    int note[MAX_VOICES];
+    uint32_t startedAt[MAX_VOICES];
+    bool released[MAX_VOICES];
+    bool stolen[MAX_VOICES];      // Fading out, restarts with the pending note after this block
+    uint32_t pendingIncrement[MAX_VOICES];
+    float pendingGain[MAX_VOICES];
+    int active[MAX_VOICES];       // Indices of sounding voices, in no particular order
+    int activeCount;
+    int freeList[MAX_VOICES];
+    int freeCount;
+    uint32_t noteCounter;
+    double sampleRate;
+    
+    VoicePool() : phase(), increment(), gain(), targetGain(), note(), startedAt(), released(),
+                  stolen(), pendingIncrement(), pendingGain(), active(), activeCount(0), freeList(), freeCount(MAX_VOICES), noteCounter(0),
+                  sampleRate(DEFAULT_SAMPLE_RATE) {
+        for(int v = 0; v < MAX_VOICES; v++) {
+            freeList[v] = MAX_VOICES - 1 - v;
+        }
+    }
+    
+    void noteOn(int midiNote, float frequency, float amplitude) {
+        int v;
+        if(freeCount > 0) {
+            v = freeList[--freeCount];
+            active[activeCount++] = v;
+        } else {
+            // Steal the voice that started first. Restarting it in place would
+            // jump the waveform, so fade it out over this block and start the
+            // new note from silence in the next one.
+            int oldest = 0;
+            for(int n = 1; n < activeCount; n++) {
+                if(noteCounter - startedAt[active[n]] > noteCounter - startedAt[active[oldest]]) oldest = n;
+            }
+            v = active[oldest];
+            stolen[v] = true;
+            pendingIncrement[v] = phaseIncrement(frequency, sampleRate);
+            pendingGain[v] = amplitude;
+            targetGain[v] = 0.0f;
+            note[v] = midiNote;
+            startedAt[v] = noteCounter++;
+            released[v] = false;
+            return;
+        }
+        phase[v] = 0;
+        increment[v] = phaseIncrement(frequency, sampleRate);
+        gain[v] = 0.0f;
+        targetGain[v] = amplitude;
+        note[v] = midiNote;
+        startedAt[v] = noteCounter++;
+        released[v] = false;
+    }
+    
+    void noteOff(int midiNote) {
+        for(int n = 0; n < activeCount; n++) {
+            int v = active[n];
+            if(note[v] == midiNote && !released[v]) {
+                released[v] = true;
+                targetGain[v] = 0.0f;
+            }
+        }
+    }
+    
+    void apply(const NoteEvent& event) {
+        if(event.on) {
+            noteOn(event.note, 440.0f * powf(2.0f, (event.note - 69) / 12.0f), event.amplitude);
+        } else {
+            noteOff(event.note);
+        }
+    }
+    
+    // Called once a released voice has ramped down to silence
+    void retire(int n) {
+        stolen[active[n]] = false;
+        freeList[freeCount++] = active[n];
+        active[n] = active[--activeCount];
+    }
+    
+    // Called once a stolen voice has ramped down to silence
+    void restart(int v) {
+        stolen[v] = false;
+        phase[v] = 0;
+        increment[v] = pendingIncrement[v];
+        gain[v] = 0.0f;
+        targetGain[v] = pendingGain[v];
+    }
+};
+
+// What an audio backend tells the engine about each buffer it asks for.
+// Times are in seconds on the backend's own clock (AudioBackend::time()).
+struct AudioCallbackInfo {
+    double currentTime;
+    double outputTime;    // When the first frame of this buffer reaches the DAC, 0 if unknown
+    bool outputUnderflow; // The device ran dry since the previous buffer
+    bool outputOverflow;
+};
+
+// Callback duration as a fraction of the buffer period, in 5% bins; the last
+// bin collects every callback that overran its period
+#define LOAD_HISTOGRAM_BINS 21
+
+// Per-callback timing and stream status counters. Only the audio callback
+// writes them (plain load/store, no read-modify-write needed with a single
+// writer); any other thread can read them at any time.
+struct CallbackStats {
+    std::atomic<uint64_t> callbacks;
+    std::atomic<uint64_t> outputUnderflows;
+    std::atomic<uint64_t> outputOverflows;
+    std::atomic<uint64_t> histogram[LOAD_HISTOGRAM_BINS];
+    std::atomic<float> lastLoad;
+    std::atomic<float> peakLoad;
+    std::atomic<float> minLeadSeconds; // Smallest gap between the callback and its buffer's DAC time
+    
+    CallbackStats() : callbacks(0), outputUnderflows(0), outputOverflows(0), lastLoad(0.0f),
+                      peakLoad(0.0f), minLeadSeconds(INFINITY) {
+        for(auto& bin : histogram) bin.store(0, std::memory_order_relaxed);
+    }
+    
+    // Audio thread
+    void record(double seconds, double periodSeconds, const AudioCallbackInfo& info) {
+        bump(callbacks);
+        if(info.outputUnderflow) bump(outputUnderflows);
+        if(info.outputOverflow) bump(outputOverflows);
+        
+        float load = (float)(seconds / periodSeconds);
+        int bin = std::min(LOAD_HISTOGRAM_BINS - 1, (int)(load * (LOAD_HISTOGRAM_BINS - 1)));
+        bump(histogram[bin]);
+        lastLoad.store(load, std::memory_order_relaxed);
+        if(load > peakLoad.load(std::memory_order_relaxed)) {
+            peakLoad.store(load, std::memory_order_relaxed);
+        }
+        
+        if(info.outputTime > 0.0) {
+            float lead = (float)(info.outputTime - info.currentTime);
+            if(lead < minLeadSeconds.load(std::memory_order_relaxed)) {
+                minLeadSeconds.store(lead, std::memory_order_relaxed);
+            }
+        }
+    }
+    
+    void dump(std::ostream& out) const {
+        uint64_t total = callbacks.load(std::memory_order_relaxed);
+        out << "Audio callbacks: " << total
+            << ", output underflows: " << outputUnderflows.load(std::memory_order_relaxed)
+            << ", output overflows: " << outputOverflows.load(std::memory_order_relaxed) << std::endl;
+        out << "Peak callback load: " << 100.0f * peakLoad.load(std::memory_order_relaxed) << "% of buffer period";
+        float lead = minLeadSeconds.load(std::memory_order_relaxed);
+        if(std::isfinite(lead)) out << ", min lead to DAC: " << lead * 1000.0f << " ms";
+        out << std::endl;
+        if(total == 0) return;
+        out << "Callback load histogram:" << std::endl;
+        for(int bin = 0; bin < LOAD_HISTOGRAM_BINS; bin++) {
+            uint64_t count = histogram[bin].load(std::memory_order_relaxed);
+            if(count == 0) continue;
+            char line[64];
+            if(bin == LOAD_HISTOGRAM_BINS - 1) {
+                snprintf(line, sizeof(line), "  >=100%%   %10llu", (unsigned long long)count);
+            } else {
+                snprintf(line, sizeof(line), "  %3d-%3d%%  %10llu", bin * 5, bin * 5 + 5, (unsigned long long)count);
+            }
+            out << line << std::endl;
+        }
+    }
+    
+private:
+    static void bump(std::atomic<uint64_t>& counter) {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+};
+
+// Real-time setup. Process-wide steps (locking and prefaulting memory) run
+// on the main thread before the stream starts; per-thread steps (SCHED_FIFO,
+// FTZ/DAZ, prefaulting the stack) run on the audio thread's first callback
+// and on each render worker. Results go into atomics for the main thread to
+// report, since the audio thread can't print.
+#define RT_PRIORITY 70
+#define RT_STACK_PREFAULT_BYTES (64 * 1024)
+#define RT_OK 0
+#define RT_NOT_TRIED -1
+#define RT_UNSUPPORTED -2   // Anything else is an errno
+
+enum RealtimeStep { RT_MLOCKALL, RT_PREFAULT, RT_SCHED_FIFO, RT_FTZ_DAZ, RT_STEP_COUNT };
+static const char* const realtimeStepNames[RT_STEP_COUNT] = {"mlockall", "prefault", "SCHED_FIFO", "FTZ/DAZ"};
+
+struct RealtimeStatus {
+    std::atomic<int> result[RT_STEP_COUNT];
+    std::atomic<int> threadSetups;  // Bumped each time an audio thread has set itself up
+    std::atomic<int> workersFifo;   // Render workers and DSP thread running SCHED_FIFO
+    std::atomic<int> workers;
+    
+    RealtimeStatus() : threadSetups(0), workersFifo(0), workers(0) {
+        for(auto& r : result) r.store(RT_NOT_TRIED, std::memory_order_relaxed);
+    }
+    
+    void report(std::ostream& out) const {
+        out << "Real-time setup:";
+        for(int step = 0; step < RT_STEP_COUNT; step++) {
+            int r = result[step].load(std::memory_order_relaxed);
+            out << " " << realtimeStepNames[step] << " ";
+            if(r == RT_OK) {
+                out << "ok";
+            } else if(r == RT_NOT_TRIED) {
+                out << "skipped";
+            } else if(r == RT_UNSUPPORTED) {
+                out << "unsupported";
+            } else {
+                out << "failed (" << strerror(r) << ")";
+            }
+            if(step + 1 < RT_STEP_COUNT) out << ",";
+        }
+        out << std::endl;
+        int total = workers.load(std::memory_order_relaxed);
+        if(total > 0) {
+            out << "Render threads on SCHED_FIFO: " << workersFifo.load(std::memory_order_relaxed)
+                << " of " << total << std::endl;
+        }
+        if(result[RT_SCHED_FIFO].load(std::memory_order_relaxed) == EPERM ||
+           result[RT_MLOCKALL].load(std::memory_order_relaxed) == ENOMEM) {
+            out << "  (raise rtprio and memlock in /etc/security/limits.conf, or grant CAP_SYS_NICE)" << std::endl;
+        }
+    }
+};
+
+// Write every page so none of them faults later; only while no other thread uses the memory
+static void prefaultMemory(void* begin, size_t bytes) {
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    volatile char* p = (volatile char*)begin;
+    for(size_t i = 0; i < bytes; i += page) p[i] = p[i];
+    if(bytes > 0) p[bytes - 1] = p[bytes - 1];
+}
+
+static void __attribute__((noinline)) prefaultStack() {
+    volatile char stack[RT_STACK_PREFAULT_BYTES];
+    for(size_t i = 0; i < sizeof(stack); i += 1024) stack[i] = 0;
+}
+
+// Denormals turn a decaying voice ramp into a CPU spike; flush them to zero
+static int enableFlushToZero() {
+#if defined(__SSE__) || defined(_M_X64)
+    _mm_setcsr(_mm_getcsr() | 0x8040); // FTZ (bit 15) and DAZ (bit 6)
+    return RT_OK;
+#elif defined(__aarch64__)
+    uint64_t fpcr;
+    __asm__ __volatile__("mrs %0, fpcr" : "=r"(fpcr));
+    __asm__ __volatile__("msr fpcr, %0" : : "r"(fpcr | (1ull << 24))); // FZ
+    return RT_OK;
+#else
+    return RT_UNSUPPORTED;
+#endif
+}
+
+// Returns RT_OK if the calling thread ends up on a real-time policy
+static int enableRealtimeScheduling(int priority) {
+    int policy;
+    sched_param param;
+    if(pthread_getschedparam(pthread_self(), &policy, &param) == 0 &&
+       (policy == SCHED_FIFO || policy == SCHED_RR) && param.sched_priority >= priority) {
+        return RT_OK; // The backend already did it
+    }
+    param.sched_priority = std::min(priority, sched_get_priority_max(SCHED_FIFO));
+    return pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+}
+
+// Main thread, before the stream starts
+static void prepareRealtimeProcess(RealtimeStatus& status, void* data, size_t bytes) {
+    status.result[RT_MLOCKALL].store(mlockall(MCL_CURRENT | MCL_FUTURE) == 0 ? RT_OK : errno,
+                                     std::memory_order_relaxed);
+    prefaultMemory(data, bytes);
+    status.result[RT_PREFAULT].store(RT_OK, std::memory_order_relaxed);
+}
+
+// Audio thread, first callback
+static void prepareRealtimeThread(RealtimeStatus& status) {
+    status.result[RT_SCHED_FIFO].store(enableRealtimeScheduling(RT_PRIORITY), std::memory_order_relaxed);
+    status.result[RT_FTZ_DAZ].store(enableFlushToZero(), std::memory_order_relaxed);
+    prefaultStack();
+    status.threadSetups.fetch_add(1, std::memory_order_release);
+}
+
+struct RenderPool;
+struct Recorder;
+
+struct SawtoothData {
+    SawtoothParams current;     // Audio thread's parameters, changed only through paramEvents
+    uint32_t phase;
+    ScopeBuffer scope;
+    int scopeSkip;              // Frames to skip before the next scope sample
+    alignas(16) float block[OSC_BLOCK_FRAMES];
+    WavetableBank wavetables;   // Built once before the stream starts
+    SpscQueue<NoteEvent, 256> notes; // Note on/off from the UI thread
+    VoicePool voices;
+    alignas(16) float voiceBlock[OSC_BLOCK_FRAMES];
+    RenderPool* renderPool;     // Optional voice rendering threads
+    int singleThreadedBlocks;   // Blocks left before trying the render pool again
+    CallbackStats stats;
+    double sampleRate;
+    unsigned long scopeDecimation; // One scope sample every N audio frames
+    SpscQueue<ParamEvent, 256> paramEvents; // Timestamped changes from the UI thread or timeline
+    double eventDelay;          // Seconds from an event's time to when it is heard
+    ParamRamp frequencyRamp;    // Smoothed versions of current's continuous parameters
+    ParamRamp phaseRamp;
+    ParamRamp amplitudeRamp;
+    RealtimeStatus realtime;
+    bool realtimeEnabled;
+    bool realtimeThreadReady;   // Audio thread only; cleared before every stream start
+    std::atomic<Recorder*> recorder; // Optional capture of everything rendered
+    
+    SawtoothData() : current({440.0f, 0.0f, 0.3f, WAVE_SAW, OSC_NAIVE}), phase(0),
+                     scopeSkip(0), block(), voiceBlock(),
+                     renderPool(nullptr), singleThreadedBlocks(0), eventDelay(0.0),
+                     frequencyRamp(current.frequency, DEFAULT_FREQUENCY_SMOOTHING, true),
+                     phaseRamp(current.phaseOffset, DEFAULT_PHASE_SMOOTHING, false),
+                     amplitudeRamp(current.amplitude, DEFAULT_AMPLITUDE_SMOOTHING, false),
+                     realtimeEnabled(false),
+                     realtimeThreadReady(false), recorder(nullptr) {
+        setSampleRate(DEFAULT_SAMPLE_RATE);
+    }
+    
+    // Only while no stream is running
+    void setSampleRate(double rate) {
+        sampleRate = rate;
+        voices.sampleRate = rate;
+        scopeDecimation = std::max(1L, lround(rate / SCOPE_RATE));
+    }
+};
+
+// Naive (aliasing) shapes straight from the phase. Reinterpreting the phase
+// shifted by half a cycle as a signed integer gives (2 * phase - 1) directly;
+// the square is the sign of the first half-cycle and the triangle folds the saw.
+static inline float naiveShape(uint32_t phase, int waveform) {
+    float saw = (int32_t)(phase ^ 0x80000000u) * (1.0f / 2147483648.0f);
+    switch(waveform) {
+        case WAVE_SQUARE: return (float)(((int32_t)phase >> 31) | 1);
+        case WAVE_TRIANGLE: return 2.0f * fabsf(saw) - 1.0f;
+        default: return saw;
+    }
+}
+
+#if defined(WAVE_SIMD_SSE2)
+static inline __m128 naiveShape(__m128i phase, int waveform) {
+    __m128 saw = _mm_mul_ps(_mm_cvtepi32_ps(_mm_xor_si128(phase, _mm_set1_epi32((int)0x80000000u))),
+                            _mm_set1_ps(1.0f / 2147483648.0f));
+    switch(waveform) {
+        case WAVE_SQUARE:
+            return _mm_cvtepi32_ps(_mm_or_si128(_mm_srai_epi32(phase, 31), _mm_set1_epi32(1)));
+        case WAVE_TRIANGLE: {
+            __m128 magnitude = _mm_andnot_ps(_mm_set1_ps(-0.0f), saw);
+            return _mm_sub_ps(_mm_add_ps(magnitude, magnitude), _mm_set1_ps(1.0f));
+        }
+        default: return saw;
+    }
+}
+#elif defined(WAVE_SIMD_NEON)
+static inline float32x4_t naiveShape(uint32x4_t phase, int waveform) {
+    int32x4_t signedPhase = vreinterpretq_s32_u32(phase);
+    float32x4_t saw = vmulq_n_f32(vcvtq_f32_s32(vreinterpretq_s32_u32(veorq_u32(phase, vdupq_n_u32(0x80000000u)))),
+                                  1.0f / 2147483648.0f);
+    switch(waveform) {
+        case WAVE_SQUARE:
+            return vcvtq_f32_s32(vorrq_s32(vshrq_n_s32(signedPhase, 31), vdupq_n_s32(1)));
+        case WAVE_TRIANGLE:
+            return vsubq_f32(vmulq_n_f32(vabsq_f32(saw), 2.0f), vdupq_n_f32(1.0f));
+        default: return saw;
+    }
+}
+#endif
+
+// Parameter ramps inside a block: the kernels take the phase increment and
+// amplitude at the first frame plus a per-frame step for each, so a smoothed
+// parameter costs a couple of vector adds instead of a per-sample recursion.
+// With the increment ramping linearly the phase after n frames has a closed
+// form, so each SIMD lane still only depends on the lane four frames back.
+static inline uint32_t rampedPhase(uint32_t phase, uint32_t increment, int32_t incrementStep, unsigned long n) {
+    return phase + increment * (uint32_t)n + (uint32_t)incrementStep * (uint32_t)(n * (n - 1) / 2);
+}
+
+#if defined(WAVE_SIMD_SSE2)
+// Lanes hold frames i..i+3: phases, increments and gains
+struct RampLanes {
+    __m128i phase, increment;
+    __m128 gain;
+    __m128i phaseStep, incrementStep;
+    __m128 gainStep;
+    
+    RampLanes(uint32_t p, uint32_t inc, int32_t incStep, float amplitude, float amplitudeStep) {
+        phase = _mm_setr_epi32((int)p, (int)(p + inc), (int)(p + inc * 2 + incStep),
+                               (int)(p + inc * 3 + incStep * 3));
+        increment = _mm_setr_epi32((int)inc, (int)(inc + incStep), (int)(inc + incStep * 2),
+                                   (int)(inc + incStep * 3));
+        gain = _mm_setr_ps(amplitude, amplitude + amplitudeStep, amplitude + amplitudeStep * 2.0f,
+                           amplitude + amplitudeStep * 3.0f);
+        phaseStep = _mm_set1_epi32(incStep * 6);
+        incrementStep = _mm_set1_epi32(incStep * 4);
+        gainStep = _mm_set1_ps(amplitudeStep * 4.0f);
+    }
+    
+    void advance() {
+        phase = _mm_add_epi32(phase, _mm_add_epi32(_mm_slli_epi32(increment, 2), phaseStep));
+        increment = _mm_add_epi32(increment, incrementStep);
+        gain = _mm_add_ps(gain, gainStep);
+    }
+};
+#elif defined(WAVE_SIMD_NEON)
+struct RampLanes {
+    uint32x4_t phase, increment;
+    float32x4_t gain;
+    uint32x4_t phaseStep, incrementStep;
+    float32x4_t gainStep;
+    
+    RampLanes(uint32_t p, uint32_t inc, int32_t incStep, float amplitude, float amplitudeStep) {
+        const uint32_t step = (uint32_t)incStep;
+        const uint32_t phases[4] = {p, p + inc, p + inc * 2 + step, p + inc * 3 + step * 3};
+        const uint32_t increments[4] = {inc, inc + step, inc + step * 2, inc + step * 3};
+        const float gains[4] = {amplitude, amplitude + amplitudeStep, amplitude + amplitudeStep * 2.0f,
+                                amplitude + amplitudeStep * 3.0f};
+        phase = vld1q_u32(phases);
+        increment = vld1q_u32(increments);
+        gain = vld1q_f32(gains);
+        phaseStep = vdupq_n_u32(step * 6);
+        incrementStep = vdupq_n_u32(step * 4);
+        gainStep = vdupq_n_f32(amplitudeStep * 4.0f);
+    }
+    
+    void advance() {
+        phase = vaddq_u32(phase, vaddq_u32(vshlq_n_u32(increment, 2), phaseStep));
+        increment = vaddq_u32(increment, incrementStep);
+        gain = vaddq_f32(gain, gainStep);
+    }
+};
+#endif
+
+// Render one mono block of a naive waveform
+static void renderNaiveBlock(float* out, unsigned long frames, uint32_t phase, uint32_t increment,
+                             float amplitude, int waveform, int32_t incrementStep = 0, float amplitudeStep = 0.0f) {
+    unsigned long i = 0;
+#if defined(WAVE_SIMD_SSE2)
+    for(RampLanes lanes(phase, increment, incrementStep, amplitude, amplitudeStep); i + 4 <= frames; i += 4) {
+        _mm_storeu_ps(out + i, _mm_mul_ps(naiveShape(lanes.phase, waveform), lanes.gain));
+        lanes.advance();
+    }
+#elif defined(WAVE_SIMD_NEON)
+    for(RampLanes lanes(phase, increment, incrementStep, amplitude, amplitudeStep); i + 4 <= frames; i += 4) {
+        vst1q_f32(out + i, vmulq_f32(naiveShape(lanes.phase, waveform), lanes.gain));
+        lanes.advance();
+    }
+#endif
+    uint32_t p = rampedPhase(phase, increment, incrementStep, i);
+    uint32_t inc = increment + (uint32_t)incrementStep * (uint32_t)i;
+    for(; i < frames; i++) {
+        out[i] = naiveShape(p, waveform) * (amplitude + amplitudeStep * i);
+        p += inc;
+        inc += (uint32_t)incrementStep;
+    }
+}
+
+// Render one mono block from a band-limited table with linear interpolation.
+// The top WAVETABLE_BITS of the phase index the table, the rest is the fraction.
+static void renderWavetableBlock(float* out, unsigned long frames, const float* table,
+                                 uint32_t phase, uint32_t increment, float amplitude,
+                                 int32_t incrementStep = 0, float amplitudeStep = 0.0f) {
+    const int fractionBits = 32 - WAVETABLE_BITS;
+    const float fractionScale = 1.0f / (float)(1u << fractionBits);
+    for(unsigned long i = 0; i < frames; i++) {
+        uint32_t index = phase >> fractionBits;
+        float fraction = (phase & ((1u << fractionBits) - 1)) * fractionScale;
+        float a = table[index];
+        out[i] = (a + (table[index + 1] - a) * fraction) * (amplitude + amplitudeStep * i);
+        phase += increment;
+        increment += (uint32_t)incrementStep;
+    }
+}
+
+// PolyBLEP: the naive shape plus a two-sample polynomial residual around each
+// discontinuity (BLEP) or slope change (BLAMP, for the triangle). Both residuals
+// are evaluated for every sample and masked, so the loop has no branches and
+// each sample only depends on its own phase.
+static inline float polyBlep(float t, float dt, float invDt) {
+    float head = 1.0f - t * invDt;         // t < dt
+    float tail = 1.0f + (t - 1.0f) * invDt; // t > 1 - dt
+    return (t < dt ? -head * head : 0.0f) + (t > 1.0f - dt ? tail * tail : 0.0f);
+}
+
+static inline float polyBlamp(float t, float dt, float invDt) {
+    float head = t * invDt - 1.0f;
+    float tail = (t - 1.0f) * invDt + 1.0f;
+    return (t < dt ? -head * head * head : 0.0f) * (1.0f / 3.0f) +
+           (t > 1.0f - dt ? tail * tail * tail : 0.0f) * (1.0f / 3.0f);
+}
+
+static inline float polyBlepShape(uint32_t phase, float dt, float invDt, int waveform) {
+    const float toUnit = 1.0f / 16777216.0f; // Top 24 bits of the phase are exact in a float
+    float t = (phase >> 8) * toUnit;
+    float half = ((phase + 0x80000000u) >> 8) * toUnit;
+    float naive = naiveShape(phase, waveform);
+    switch(waveform) {
+        case WAVE_SQUARE: return naive + polyBlep(t, dt, invDt) - polyBlep(half, dt, invDt);
+        case WAVE_TRIANGLE: return naive + 4.0f * dt * (polyBlamp(half, dt, invDt) - polyBlamp(t, dt, invDt));
+        default: return naive - polyBlep(t, dt, invDt);
+    }
+}
+
+#if defined(WAVE_SIMD_SSE2)
+static inline __m128 polyBlep(__m128 t, __m128 dt, __m128 invDt) {
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128 head = _mm_sub_ps(one, _mm_mul_ps(t, invDt));
+    __m128 tail = _mm_add_ps(one, _mm_mul_ps(_mm_sub_ps(t, one), invDt));
+    head = _mm_and_ps(_mm_cmplt_ps(t, dt), _mm_mul_ps(head, head));
+    tail = _mm_and_ps(_mm_cmpgt_ps(t, _mm_sub_ps(one, dt)), _mm_mul_ps(tail, tail));
+    return _mm_sub_ps(tail, head);
+}
+
+static inline __m128 polyBlamp(__m128 t, __m128 dt, __m128 invDt) {
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128 head = _mm_sub_ps(_mm_mul_ps(t, invDt), one);
+    __m128 tail = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(t, one), invDt), one);
+    head = _mm_and_ps(_mm_cmplt_ps(t, dt), _mm_mul_ps(_mm_mul_ps(head, head), head));
+    tail = _mm_and_ps(_mm_cmpgt_ps(t, _mm_sub_ps(one, dt)), _mm_mul_ps(_mm_mul_ps(tail, tail), tail));
+    return _mm_mul_ps(_mm_sub_ps(tail, head), _mm_set1_ps(1.0f / 3.0f));
+}
+
+static inline __m128 polyBlepShape(__m128i phase, __m128 dt, __m128 invDt, int waveform) {
+    const __m128 toUnit = _mm_set1_ps(1.0f / 16777216.0f);
+    __m128 t = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(phase, 8)), toUnit);
+    __m128i halfPhase = _mm_add_epi32(phase, _mm_set1_epi32((int)0x80000000u));
+    __m128 half = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(halfPhase, 8)), toUnit);
+    __m128 naive = naiveShape(phase, waveform);
+    switch(waveform) {
+        case WAVE_SQUARE:
+            return _mm_add_ps(naive, _mm_sub_ps(polyBlep(t, dt, invDt), polyBlep(half, dt, invDt)));
+        case WAVE_TRIANGLE: {
+            __m128 blamp = _mm_sub_ps(polyBlamp(half, dt, invDt), polyBlamp(t, dt, invDt));
+            return _mm_add_ps(naive, _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(4.0f), dt), blamp));
+        }
+        default:
+            return _mm_sub_ps(naive, polyBlep(t, dt, invDt));
+    }
+}
+#elif defined(WAVE_SIMD_NEON)
+static inline float32x4_t maskSelect(uint32x4_t mask, float32x4_t value) {
+    return vreinterpretq_f32_u32(vandq_u32(mask, vreinterpretq_u32_f32(value)));
+}
+
+static inline float32x4_t polyBlep(float32x4_t t, float32x4_t dt, float32x4_t invDt) {
+    const float32x4_t one = vdupq_n_f32(1.0f);
+    float32x4_t head = vmlsq_f32(one, t, invDt);
+    float32x4_t tail = vmlaq_f32(one, vsubq_f32(t, one), invDt);
+    head = maskSelect(vcltq_f32(t, dt), vmulq_f32(head, head));
+    tail = maskSelect(vcgtq_f32(t, vsubq_f32(one, dt)), vmulq_f32(tail, tail));
+    return vsubq_f32(tail, head);
+}
+
+static inline float32x4_t polyBlamp(float32x4_t t, float32x4_t dt, float32x4_t invDt) {
+    const float32x4_t one = vdupq_n_f32(1.0f);
+    float32x4_t head = vsubq_f32(vmulq_f32(t, invDt), one);
+    float32x4_t tail = vmlaq_f32(one, vsubq_f32(t, one), invDt);
+    head = maskSelect(vcltq_f32(t, dt), vmulq_f32(vmulq_f32(head, head), head));
+    tail = maskSelect(vcgtq_f32(t, vsubq_f32(one, dt)), vmulq_f32(vmulq_f32(tail, tail), tail));
+    return vmulq_n_f32(vsubq_f32(tail, head), 1.0f / 3.0f);
+}
+
+static inline float32x4_t polyBlepShape(uint32x4_t phase, float32x4_t dt, float32x4_t invDt, int waveform) {
+    const float toUnit = 1.0f / 16777216.0f;
+    float32x4_t t = vmulq_n_f32(vcvtq_f32_u32(vshrq_n_u32(phase, 8)), toUnit);
+    uint32x4_t halfPhase = vaddq_u32(phase, vdupq_n_u32(0x80000000u));
+    float32x4_t half = vmulq_n_f32(vcvtq_f32_u32(vshrq_n_u32(halfPhase, 8)), toUnit);
+    float32x4_t naive = naiveShape(phase, waveform);
+    switch(waveform) {
+        case WAVE_SQUARE:
+            return vaddq_f32(naive, vsubq_f32(polyBlep(t, dt, invDt), polyBlep(half, dt, invDt)));
+        case WAVE_TRIANGLE: {
+            float32x4_t blamp = vsubq_f32(polyBlamp(half, dt, invDt), polyBlamp(t, dt, invDt));
+            return vmlaq_f32(naive, vmulq_n_f32(dt, 4.0f), blamp);
+        }
+        default:
+            return vsubq_f32(naive, polyBlep(t, dt, invDt));
+    }
+}
+#endif
+
+// While the frequency ramps, dt follows each lane's own increment
+static void renderPolyBlepBlock(float* out, unsigned long frames, uint32_t phase, uint32_t increment,
+                                float amplitude, int waveform, int32_t incrementStep = 0, float amplitudeStep = 0.0f) {
+    // Keep dt away from zero so the residual polynomials stay finite at 0 Hz
+    const float toDt = (float)(1.0 / PHASE_ONE);
+    const float dt = std::max(increment * toDt, 1e-7f);
+    const float invDt = 1.0f / dt;
+    unsigned long i = 0;
+#if defined(WAVE_SIMD_SSE2)
+    __m128 vDt = _mm_set1_ps(dt);
+    __m128 vInvDt = _mm_set1_ps(invDt);
+    for(RampLanes lanes(phase, increment, incrementStep, amplitude, amplitudeStep); i + 4 <= frames; i += 4) {
+        if(incrementStep != 0) {
+            vDt = _mm_max_ps(_mm_mul_ps(_mm_cvtepi32_ps(lanes.increment), _mm_set1_ps(toDt)), _mm_set1_ps(1e-7f));
+            vInvDt = _mm_div_ps(_mm_set1_ps(1.0f), vDt);
+        }
+        _mm_storeu_ps(out + i, _mm_mul_ps(polyBlepShape(lanes.phase, vDt, vInvDt, waveform), lanes.gain));
+        lanes.advance();
+    }
+#elif defined(WAVE_SIMD_NEON)
+    float32x4_t vDt = vdupq_n_f32(dt);
+    float32x4_t vInvDt = vdupq_n_f32(invDt);
+    for(RampLanes lanes(phase, increment, incrementStep, amplitude, amplitudeStep); i + 4 <= frames; i += 4) {
+        if(incrementStep != 0) {
+            vDt = vmaxq_f32(vmulq_n_f32(vcvtq_f32_u32(lanes.increment), toDt), vdupq_n_f32(1e-7f));
+            vInvDt = vrecpeq_f32(vDt);
+            vInvDt = vmulq_f32(vInvDt, vrecpsq_f32(vDt, vInvDt)); // Two Newton steps to full precision
+            vInvDt = vmulq_f32(vInvDt, vrecpsq_f32(vDt, vInvDt));
+        }
+        vst1q_f32(out + i, vmulq_f32(polyBlepShape(lanes.phase, vDt, vInvDt, waveform), lanes.gain));
+        lanes.advance();
+    }
+#endif
+    uint32_t p = rampedPhase(phase, increment, incrementStep, i);
+    uint32_t inc = increment + (uint32_t)incrementStep * (uint32_t)i;
+    for(; i < frames; i++) {
+        float laneDt = incrementStep != 0 ? std::max(inc * toDt, 1e-7f) : dt;
+        float laneInvDt = incrementStep != 0 ? 1.0f / laneDt : invDt;
+        out[i] = polyBlepShape(p, laneDt, laneInvDt, waveform) * (amplitude + amplitudeStep * i);
+        p += inc;
+        inc += (uint32_t)incrementStep;
+    }
+}
+
+static void renderOscillatorBlock(const WavetableBank& wavetables, int mode, int waveform, float* out,
+                                  unsigned long frames, uint32_t phase, uint32_t increment, float amplitude,
+                                  int32_t incrementStep = 0, float amplitudeStep = 0.0f) {
+    if(mode == OSC_WAVETABLE) {
+        // Pick the table for the highest frequency reached in the block
+        uint32_t lastIncrement = increment + (uint32_t)incrementStep * (uint32_t)(frames - 1);
+        const float* table = wavetables.table(waveform, WavetableBank::levelFor(std::max(increment, lastIncrement)));
+        renderWavetableBlock(out, frames, table, phase, increment, amplitude, incrementStep, amplitudeStep);
+    } else if(mode == OSC_POLYBLEP) {
+        renderPolyBlepBlock(out, frames, phase, increment, amplitude, waveform, incrementStep, amplitudeStep);
+    } else {
+        renderNaiveBlock(out, frames, phase, increment, amplitude, waveform, incrementStep, amplitudeStep);
+    }
+}
+
+// mix += in * gain, with gain ramping linearly from 'from' towards 'to' so
+// that voices starting, stopping or being stolen don't click (a stolen voice
+// ramps to zero here and only restarts in the following block)
+static void mixWithRamp(float* mix, const float* in, unsigned long frames, float from, float to) {
+    const float step = (to - from) / frames;
+    unsigned long i = 0;
+#if defined(WAVE_SIMD_SSE2)
+    const __m128 vStep = _mm_set1_ps(step * 4.0f);
+    __m128 g = _mm_setr_ps(from, from + step, from + step * 2.0f, from + step * 3.0f);
+    for(; i + 4 <= frames; i += 4) {
+        _mm_storeu_ps(mix + i, _mm_add_ps(_mm_loadu_ps(mix + i), _mm_mul_ps(_mm_loadu_ps(in + i), g)));
+        g = _mm_add_ps(g, vStep);
+    }
+#elif defined(WAVE_SIMD_NEON)
+    const float lanes[4] = {from, from + step, from + step * 2.0f, from + step * 3.0f};
+    float32x4_t g = vld1q_f32(lanes);
+    for(; i + 4 <= frames; i += 4) {
+        vst1q_f32(mix + i, vmlaq_f32(vld1q_f32(mix + i), vld1q_f32(in + i), g));
+        g = vaddq_f32(g, vdupq_n_f32(step * 4.0f));
+    }
+#endif
+    for(; i < frames; i++) {
+        mix[i] += in[i] * (from + step * i);
+    }
+}
+
+// Render active voices [begin, end) into mix. Voices outside the range are not
+// touched, so disjoint ranges can be rendered on different threads.
+static void renderVoiceRange(VoicePool& pool, const WavetableBank& wavetables, int mode, int waveform,
+                             float* mix, float* scratch, unsigned long frames, int begin, int end) {
+    for(int n = begin; n < end; n++) {
+        int v = pool.active[n];
+        renderOscillatorBlock(wavetables, mode, waveform, scratch, frames, pool.phase[v], pool.increment[v], 1.0f);
+        mixWithRamp(mix, scratch, frames, pool.gain[v], pool.targetGain[v]);
+        pool.gain[v] = pool.targetGain[v];
+        pool.phase[v] += pool.increment[v] * (uint32_t)frames;
+    }
+}
+
+// Released and stolen voices have ramped to silence over the block just
+// rendered. A stolen voice whose new note was already released never sounds.
+static void retireReleasedVoices(VoicePool& pool) {
+    for(int n = 0; n < pool.activeCount; ) {
+        int v = pool.active[n];
+        if(pool.released[v]) {
+            pool.retire(n); // Swaps the last active voice into slot n
+        } else {
+            if(pool.stolen[v]) pool.restart(v);
+            n++;
+        }
+    }
+}
+
+// Add every active voice of the pool into mix
+static void renderVoices(VoicePool& pool, const WavetableBank& wavetables, int mode, int waveform,
+                         float* mix, float* scratch, unsigned long frames) {
+    renderVoiceRange(pool, wavetables, mode, waveform, mix, scratch, frames, 0, pool.activeCount);
+    retireReleasedVoices(pool);
+}
+
+static inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// Worker threads that render voice partitions alongside the audio callback.
+// The callback publishes a job by storing a new jobState, then claims
+// partitions itself just like the workers do, so a worker that is asleep when
+// the job starts only costs parallelism. A worker preempted after claiming a
+// partition does hold up the block: the callback spins until every claimed
+// partition is done, with no bound. Live audio therefore only uses the pool
+// once every worker runs SCHED_FIFO, and a long wait still drops back to one
+// thread for a second. Workers spin for a short while after each job and
+// then sleep on a condition variable.
+//
+// jobState packs generation (16 bits) | next partition (8) | partition count (8).
+// A claim is a CAS that only succeeds for the current generation while
+// partitions are left, so a late worker can never touch a finished job, and
+// the job fields stay untouched until every claimed partition has finished.
+#define MAX_RENDER_WORKERS 8
+#define MAX_VOICE_PARTITIONS 8
+#define MIN_VOICES_PER_PARTITION 16
+
+struct RenderPool {
+    std::vector<std::thread> threads;
+    std::atomic<bool> running;
+    std::atomic<uint32_t> jobState;
+    std::atomic<int> finishedPartitions;
+    std::atomic<int> sleepers;
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    int spinMicroseconds;
+    std::atomic<uint32_t> fallbacks; // Times the callback dropped back to one thread
+    std::atomic<int> fifoWorkers;
+    RealtimeStatus* realtime;        // Workers set themselves up like the audio thread when set,
+                                     // and the pool waits until they all run SCHED_FIFO
+    
+    // Current job; written by the callback only while no partition is claimed
+    VoicePool* pool;
+    const WavetableBank* wavetables;
+    int mode, waveform;
+    unsigned long frames;
+    int partitionSize;
+    alignas(64) float partitionMix[MAX_VOICE_PARTITIONS][OSC_BLOCK_FRAMES];
+    alignas(64) float scratch[MAX_RENDER_WORKERS + 1][OSC_BLOCK_FRAMES];
+    
+    RenderPool() : running(false), jobState(0), finishedPartitions(0), sleepers(0), spinMicroseconds(0),
+                   fallbacks(0), fifoWorkers(0), realtime(nullptr), pool(nullptr), wavetables(nullptr), mode(0), waveform(0), frames(0),
+                   partitionSize(0) {}
+    
+    ~RenderPool() { stop(); }
+    
+    int workerCount() const { return (int)threads.size(); }
+    
+    void start(int workers, int spinUs, RealtimeStatus* realtimeStatus = nullptr) {
+        spinMicroseconds = spinUs;
+        realtime = realtimeStatus;
+        running = true;
+        for(int i = 0; i < std::min(workers, MAX_RENDER_WORKERS); i++) {
+            threads.emplace_back(&RenderPool::workerLoop, this, i);
+        }
+    }
+    
+    void stop() {
+        if(!running.exchange(false)) return;
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+        }
+        wake.notify_all();
+        for(auto& thread : threads) thread.join();
+        threads.clear();
+    }
+    
+    // Audio thread. Returns false (rendering nothing) if the job is too small to
+    // split or the workers could be preempted by ordinary threads. waitSeconds
+    // is how long the callback sat idle waiting for workers to finish.
+    bool render(VoicePool& voices, const WavetableBank& tables, int oscMode, int oscWaveform,
+                float* mix, unsigned long blockFrames, double& waitSeconds) {
+        int partitions = std::min(MAX_VOICE_PARTITIONS,
+                                  (voices.activeCount + MIN_VOICES_PER_PARTITION - 1) / MIN_VOICES_PER_PARTITION);
+        if(threads.empty() || partitions < 2) return false;
+        if(realtime && fifoWorkers.load(std::memory_order_relaxed) < workerCount()) return false;
+        
+        pool = &voices;
+        wavetables = &tables;
+        mode = oscMode;
+        waveform = oscWaveform;
+        frames = blockFrames;
+        partitionSize = (voices.activeCount + partitions - 1) / partitions;
+        partitions = (voices.activeCount + partitionSize - 1) / partitionSize;
+        finishedPartitions.store(0, std::memory_order_relaxed);
+        uint32_t generation = ((jobState.load(std::memory_order_relaxed) >> 16) + 1) & 0xFFFF;
+        jobState.store((generation << 16) | (uint32_t)partitions, std::memory_order_release);
+        if(sleepers.load(std::memory_order_relaxed) > 0) {
+            wake.notify_all();
+        }
+        
+        runPartitions(generation, 0);
+        auto waitStart = std::chrono::steady_clock::now();
+        while(finishedPartitions.load(std::memory_order_acquire) < partitions) {
+            cpuRelax();
+        }
+        waitSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - waitStart).count();
+        
+        for(int k = 0; k < partitions; k++) {
+            const float* partial = partitionMix[k];
+            for(unsigned long i = 0; i < blockFrames; i++) {
+                mix[i] += partial[i];
+            }
+        }
+        return true;
+    }
+    
+private:
+    void runPartitions(uint32_t generation, int participant) {
+        uint32_t state = jobState.load(std::memory_order_acquire);
+        while((state >> 16) == generation && ((state >> 8) & 0xFF) < (state & 0xFF)) {
+            if(!jobState.compare_exchange_weak(state, state + 0x100, std::memory_order_acq_rel)) {
+                continue;
+            }
+            int k = (state >> 8) & 0xFF;
+            int begin = k * partitionSize;
+            int end = std::min(begin + partitionSize, pool->activeCount);
+            std::fill(partitionMix[k], partitionMix[k] + frames, 0.0f);
+            renderVoiceRange(*pool, *wavetables, mode, waveform, partitionMix[k], scratch[participant],
+                             frames, begin, end);
+            finishedPartitions.fetch_add(1, std::memory_order_release);
+            state = jobState.load(std::memory_order_acquire);
+        }
+    }
+    
+    void workerLoop(int index) {
+#ifdef __linux__
+        // Keep core 0 for the audio callback and everything else
+        unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET((index + 1) % cores, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#endif
+        if(realtime) {
+            // Just below the audio thread, which waits on us
+            if(enableRealtimeScheduling(RT_PRIORITY - 1) == RT_OK) {
+                realtime->workersFifo.fetch_add(1, std::memory_order_relaxed);
+                fifoWorkers.fetch_add(1, std::memory_order_release);
+            }
+            enableFlushToZero();
+            prefaultStack();
+            realtime->workers.fetch_add(1, std::memory_order_relaxed);
+        }
+        uint32_t seen = jobState.load(std::memory_order_acquire) >> 16;
+        while(running.load(std::memory_order_relaxed)) {
+            auto spinStart = std::chrono::steady_clock::now();
+            uint32_t generation;
+            while((generation = jobState.load(std::memory_order_acquire) >> 16) == seen) {
+                if(!running.load(std::memory_order_relaxed)) return;
+                if(std::chrono::steady_clock::now() - spinStart < std::chrono::microseconds(spinMicroseconds)) {
+                    cpuRelax();
+                    continue;
+                }
+                // The callback notifies without the mutex, so a wakeup can be
+                // missed; the timeout bounds that to one job rendered without us
+                std::unique_lock<std::mutex> lock(sleepMutex);
+                sleepers++;
+                wake.wait_for(lock, std::chrono::milliseconds(2), [&] {
+                    return (jobState.load(std::memory_order_acquire) >> 16) != seen || !running;
+                });
+                sleepers--;
+            }
+            seen = generation;
+            runPartitions(generation, index + 1);
+        }
+    }
+};
+
+// Mix the voice pool into data->block, split across the render pool when it is
+// big enough. If the callback had to wait on workers for more than a quarter
+// of the block's real-time budget, render on this thread alone for about a
+// second before trying the pool again.
+static void renderVoicesForBlock(SawtoothData* data, unsigned long frames) {
+    RenderPool* renderPool = data->renderPool;
+    if(renderPool && data->singleThreadedBlocks == 0) {
+        double waitSeconds = 0.0;
+        if(renderPool->render(data->voices, data->wavetables, data->current.mode, data->current.waveform,
+                              data->block, frames, waitSeconds)) {
+            retireReleasedVoices(data->voices);
+            if(waitSeconds > 0.25 * frames / data->sampleRate) {
+                data->singleThreadedBlocks = (int)(data->sampleRate / frames);
+                renderPool->fallbacks.fetch_add(1, std::memory_order_relaxed);
+            }
+            return;
+        }
+    } else if(data->singleThreadedBlocks > 0) {
+        data->singleThreadedBlocks--;
+    }
+    renderVoices(data->voices, data->wavetables, data->current.mode, data->current.waveform,
+                 data->block, data->voiceBlock, frames);
+}
+
+// Duplicate a mono block into both channels of an interleaved stereo buffer
+static void interleaveStereo(const float* in, float* out, unsigned long frames) {
+    unsigned long i = 0;
+#if defined(WAVE_SIMD_SSE2)
+    for(; i + 4 <= frames; i += 4) {
+        __m128 v = _mm_loadu_ps(in + i);
+        _mm_storeu_ps(out + 2 * i, _mm_unpacklo_ps(v, v));
+        _mm_storeu_ps(out + 2 * i + 4, _mm_unpackhi_ps(v, v));
+    }
+#elif defined(WAVE_SIMD_NEON)
+    for(; i + 4 <= frames; i += 4) {
+        float32x4_t v = vld1q_f32(in + i);
+        float32x4x2_t pair = {{v, v}};
+        vst2q_f32(out + 2 * i, pair);
+    }
+#endif
+    for(; i < frames; i++) {
+        out[2 * i] = in[i];
+        out[2 * i + 1] = in[i];
+    }
+}
+
+static void recordBlock(Recorder* recorder, const float* in, unsigned long frames);
+
+// Frame within a buffer starting at outputTime at which an event is due. Events
+// without a time, or any event when the buffer's time is unknown, are due now.
+static long eventFrame(const SawtoothData* data, double eventTime, double outputTime) {
+    if(eventTime <= 0.0 || outputTime <= 0.0) return 0;
+    double frame = (eventTime + data->eventDelay - outputTime) * data->sampleRate;
+    return (long)std::max(0.0, std::min(frame, 1e9));
+}
+
+// Render interleaved stereo frames from the current parameters, note events
+// and voice pool. This is the whole engine; it doesn't know who is asking.
+// outputTime is when the first frame will be heard, on the backend's clock,
+// or 0 if unknown; the buffer is split wherever a timestamped event falls.
+static void renderAudio(SawtoothData* data, float* out, unsigned long framesPerBuffer, double outputTime) {
+    float* const start = out;
+    unsigned long done = 0;
+    while(done < framesPerBuffer) {
+        // Apply everything due by this frame, then render up to the next event
+        unsigned long frames = std::min<unsigned long>(framesPerBuffer - done, OSC_BLOCK_FRAMES);
+        while(const ParamEvent* event = data->paramEvents.peek()) {
+            long due = eventFrame(data, event->time, outputTime);
+            if(due > (long)done) {
+                frames = std::min<unsigned long>(frames, due - done);
+                break;
+            }
+            data->current = event->params;
+            data->paramEvents.drop();
+        }
+        while(const NoteEvent* event = data->notes.peek()) {
+            long due = eventFrame(data, event->time, outputTime);
+            if(due > (long)done) {
+                frames = std::min<unsigned long>(frames, due - done);
+                break;
+            }
+            data->voices.apply(*event);
+            data->notes.drop();
+        }
+        
+        // Each smoothed parameter ramps from its value at the end of the last
+        // block to where its ramp is at the end of this one
+        const SawtoothParams& target = data->current;
+        if(target.frequency != data->frequencyRamp.target) data->frequencyRamp.setTarget(target.frequency, data->sampleRate);
+        if(target.phaseOffset != data->phaseRamp.target) data->phaseRamp.setTarget(target.phaseOffset, data->sampleRate);
+        if(target.amplitude != data->amplitudeRamp.target) data->amplitudeRamp.setTarget(target.amplitude, data->sampleRate);
+        const float frequencyFrom = data->frequencyRamp.value;
+        const float phaseFrom = data->phaseRamp.value;
+        const float amplitudeFrom = data->amplitudeRamp.value;
+        const uint32_t incrementFrom = phaseIncrement(frequencyFrom, data->sampleRate);
+        const uint32_t incrementTo = phaseIncrement(data->frequencyRamp.advance(frames), data->sampleRate);
+        const int32_t incrementStep = (int32_t)(incrementTo - incrementFrom) / (int32_t)frames;
+        const float amplitudeStep = (data->amplitudeRamp.advance(frames) - amplitudeFrom) / frames;
+        // A moving phase offset is spread over the block as extra increment
+        const uint32_t phaseOffset = phaseFromCycles(phaseFrom);
+        const int32_t offsetStep = (int32_t)(phaseFromCycles(data->phaseRamp.advance(frames)) - phaseOffset) / (int32_t)frames;
+        
+        renderOscillatorBlock(data->wavetables, target.mode, target.waveform, data->block, frames,
+                              data->phase + phaseOffset, incrementFrom + (uint32_t)offsetStep, amplitudeFrom,
+                              incrementStep, amplitudeStep);
+        renderVoicesForBlock(data, frames);
+        interleaveStereo(data->block, out, frames);
+        
+        // Decimate into the scope, continuing the stride across blocks
+        unsigned long j = data->scopeSkip;
+        for(; j < frames; j += data->scopeDecimation) {
+            data->scope.push(data->block[j]);
+        }
+        data->scopeSkip = j - frames;
+        
+        data->phase = rampedPhase(data->phase, incrementFrom, incrementStep, frames);
+        out += frames * 2;
+        done += frames;
+    }
+    
+    data->scope.publish();
+    if(Recorder* recorder = data->recorder.load(std::memory_order_acquire)) {
+        recordBlock(recorder, start, framesPerBuffer);
+    }
+}
+
+// Audio callback, called by whichever backend is driving the engine
+static void sawtoothCallback(float* out, unsigned long framesPerBuffer, const AudioCallbackInfo& info,
+                             void* userData) {
+    auto callbackStart = std::chrono::steady_clock::now();
+    SawtoothData* data = (SawtoothData*)userData;
+    if(!data->realtimeThreadReady) {
+        if(data->realtimeEnabled) prepareRealtimeThread(data->realtime);
+        data->realtimeThreadReady = true;
+    }
+    
+    renderAudio(data, out, framesPerBuffer, info.outputTime > 0.0 ? info.outputTime : info.currentTime);
+    
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - callbackStart).count();
+    data->stats.record(elapsed, (double)framesPerBuffer / data->sampleRate, info);
+}
+
+// Single-producer single-consumer FIFO of interleaved frames. Capacity is a
+// power of two; the indices count frames forever and are masked on use.
+struct AudioFifo {
+    std::vector<float> buffer;
+    size_t capacity;
+    int channels;
+    alignas(64) std::atomic<size_t> writeFrame;
+    alignas(64) std::atomic<size_t> readFrame;
+    
+    AudioFifo() : capacity(0), channels(0), writeFrame(0), readFrame(0) {}
+    
+    // Only while neither side is running
+    void reset(size_t minFrames, int channelCount) {
+        capacity = 1;
+        while(capacity < minFrames) capacity <<= 1;
+        channels = channelCount;
+        buffer.assign(capacity * channels, 0.0f);
+        writeFrame.store(0, std::memory_order_relaxed);
+        readFrame.store(0, std::memory_order_relaxed);
+    }
+    
+    size_t readable() const {
+        return writeFrame.load(std::memory_order_acquire) - readFrame.load(std::memory_order_relaxed);
+    }
+    
+    size_t writable() const {
+        return capacity - (writeFrame.load(std::memory_order_relaxed) - readFrame.load(std::memory_order_acquire));
+    }
+    
+    // Producer; the caller checks writable() first
+    void write(const float* in, size_t frames) {
+        size_t start = writeFrame.load(std::memory_order_relaxed);
+        size_t offset = start & (capacity - 1);
+        size_t first = std::min(frames, capacity - offset);
+        memcpy(&buffer[offset * channels], in, first * channels * sizeof(float));
+        memcpy(&buffer[0], in + first * channels, (frames - first) * channels * sizeof(float));
+        writeFrame.store(start + frames, std::memory_order_release);
+    }
+    
+    // Consumer; returns the frames actually read
+    size_t read(float* out, size_t frames) {
+        size_t start = readFrame.load(std::memory_order_relaxed);
+        frames = std::min(frames, writeFrame.load(std::memory_order_acquire) - start);
+        size_t offset = start & (capacity - 1);
+        size_t first = std::min(frames, capacity - offset);
+        memcpy(out, &buffer[offset * channels], first * channels * sizeof(float));
+        memcpy(out + first * channels, &buffer[0], (frames - first) * channels * sizeof(float));
+        readFrame.store(start + frames, std::memory_order_release);
+        return frames;
+    }
+};
+
+// Render-ahead mode (--render-ahead N): a DSP thread keeps N blocks of audio
+// queued in an AudioFifo and the callback only copies them out. It costs N
+// blocks of latency and buys tolerance of DSP spikes up to about that long.
+// The callback wakes the DSP thread without taking the mutex, so a wakeup
+// can be missed; the timeout bounds that to half a block.
+// With variable-size callbacks the queue also holds the largest request seen
+// so far, up to MAX_VARIABLE_REQUEST frames, on top of the N blocks.
+#define MAX_RENDER_AHEAD 32
+#define MAX_VARIABLE_REQUEST 8192
+
+struct RenderAhead {
+    SawtoothData* data;
+    AudioFifo fifo;
+    unsigned long blockFrames;
+    size_t depthFrames;
+    size_t requestLimit;              // Largest callback request the FIFO has room for
+    bool variableRequests;
+    std::atomic<size_t> largestRequest;
+    std::vector<float> scratch;
+    std::thread thread;
+    std::atomic<bool> running;
+    std::atomic<bool> sleeping;
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    std::atomic<uint64_t> shortfalls; // Callbacks the FIFO couldn't fill
+    std::atomic<float> lastLoad;      // DSP time per block over the block's duration
+    std::atomic<float> peakLoad;
+    std::atomic<double> streamOrigin; // Backend time at which FIFO frame 0 is heard, 0 until known
+    
+    RenderAhead() : data(nullptr), blockFrames(0), depthFrames(0), requestLimit(0), variableRequests(false),
+                    largestRequest(0), running(false), sleeping(false), shortfalls(0), lastLoad(0.0f), peakLoad(0.0f), streamOrigin(0.0) {}
+    ~RenderAhead() { stop(); }
+    
+    // Main thread, before the stream starts. requestFrames is the backend's
+    // callback size, 0 if it varies. The FIFO is primed here so the first
+    // callbacks already find a full queue.
+    void start(SawtoothData* engine, unsigned long frames, int depth, unsigned long requestFrames) {
+        data = engine;
+        blockFrames = frames;
+        depthFrames = (size_t)depth * frames;
+        variableRequests = requestFrames == 0;
+        requestLimit = variableRequests ? MAX_VARIABLE_REQUEST : requestFrames;
+        largestRequest.store(variableRequests ? frames : requestFrames, std::memory_order_relaxed);
+        fifo.reset(depthFrames + requestLimit + 2 * frames, 2);
+        streamOrigin.store(0.0, std::memory_order_relaxed);
+        scratch.assign(frames * 2, 0.0f);
+        while(fifo.readable() < targetFrames()) renderBlock();
+        running = true;
+        thread = std::thread(&RenderAhead::loop, this);
+    }
+    
+    void stop() {
+        if(!running.exchange(false)) return;
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+        }
+        wake.notify_all();
+        thread.join();
+    }
+    
+    // Audio thread; outputTime is when out[0] will be heard, 0 if unknown
+    void pull(float* out, unsigned long frames, double outputTime) {
+        if(outputTime > 0.0) {
+            double origin = outputTime - (double)fifo.readFrame.load(std::memory_order_relaxed) / data->sampleRate;
+            streamOrigin.store(origin, std::memory_order_relaxed);
+        }
+        size_t got = fifo.read(out, frames);
+        if(got < frames) {
+            std::fill(out + got * 2, out + frames * 2, 0.0f);
+            shortfalls.fetch_add(1, std::memory_order_relaxed);
+        }
+        if(frames > largestRequest.load(std::memory_order_relaxed)) {
+            largestRequest.store(std::min<size_t>(frames, requestLimit), std::memory_order_relaxed);
+        }
+        if(sleeping.load(std::memory_order_relaxed)) wake.notify_one();
+    }
+    
+private:
+    // Fixed-size callbacks take a block at a time; variable ones may take more
+    size_t targetFrames() const {
+        return variableRequests ? depthFrames + largestRequest.load(std::memory_order_relaxed) : depthFrames;
+    }
+    
+    void renderBlock() {
+        auto start = std::chrono::steady_clock::now();
+        double origin = streamOrigin.load(std::memory_order_relaxed);
+        double outputTime = origin > 0.0 ? origin + (double)fifo.writeFrame.load(std::memory_order_relaxed) / data->sampleRate
+                                         : 0.0;
+        renderAudio(data, scratch.data(), blockFrames, outputTime);
+        fifo.write(scratch.data(), blockFrames);
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        float load = (float)(elapsed * data->sampleRate / blockFrames);
+        lastLoad.store(load, std::memory_order_relaxed);
+        if(load > peakLoad.load(std::memory_order_relaxed)) peakLoad.store(load, std::memory_order_relaxed);
+    }
+    
+    void loop() {
+        if(data->realtimeEnabled) {
+            // Below the callback, which must never wait on us
+            if(enableRealtimeScheduling(RT_PRIORITY - 1) == RT_OK) {
+                data->realtime.workersFifo.fetch_add(1, std::memory_order_relaxed);
+            }
+            enableFlushToZero();
+            prefaultStack();
+            data->realtime.workers.fetch_add(1, std::memory_order_relaxed);
+        }
+        const auto halfBlock = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(0.5 * blockFrames / data->sampleRate));
+        while(running.load(std::memory_order_relaxed)) {
+            while(fifo.readable() < targetFrames() && fifo.writable() >= blockFrames) {
+                renderBlock();
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            sleeping = true;
+            wake.wait_for(lock, halfBlock, [&] {
+                return fifo.readable() < targetFrames() || !running;
+            });
+            sleeping = false;
+        }
+    }
+};
+
+// Render-ahead callback: a copy out of the FIFO
+static void renderAheadCallback(float* out, unsigned long framesPerBuffer, const AudioCallbackInfo& info,
+                                void* userData) {
+    auto callbackStart = std::chrono::steady_clock::now();
+    RenderAhead* ahead = (RenderAhead*)userData;
+    SawtoothData* data = ahead->data;
+    if(!data->realtimeThreadReady) {
+        if(data->realtimeEnabled) prepareRealtimeThread(data->realtime);
+        data->realtimeThreadReady = true;
+    }
+    
+    ahead->pull(out, framesPerBuffer, info.outputTime > 0.0 ? info.outputTime : info.currentTime);
+    
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - callbackStart).count();
+    data->stats.record(elapsed, (double)framesPerBuffer / data->sampleRate, info);
+}
+
+// Header of a float WAV file, always 80 bytes. A JUNK chunk holds the place
+// of the ds64 chunk RF64 needs (EBU Tech 3306), so a recording that outgrows
+// the 4 GB RIFF limit is turned into RF64 by rewriting the header alone.
+#define WAV_HEADER_BYTES 80
+
+static void buildWavHeader(uint8_t* out, uint32_t sampleRate, int channels, uint64_t dataBytes) {
+    auto put16 = [&](size_t at, uint16_t v) { out[at] = (uint8_t)v; out[at + 1] = (uint8_t)(v >> 8); };
+    auto put32 = [&](size_t at, uint32_t v) { put16(at, (uint16_t)v); put16(at + 2, (uint16_t)(v >> 16)); };
+    auto put64 = [&](size_t at, uint64_t v) { put32(at, (uint32_t)v); put32(at + 4, (uint32_t)(v >> 32)); };
+    const uint64_t riffBytes = WAV_HEADER_BYTES - 8 + dataBytes;
+    const bool rf64 = riffBytes > 0xFFFFFFFFu;
+    memset(out, 0, WAV_HEADER_BYTES);
+    memcpy(out, rf64 ? "RF64" : "RIFF", 4);
+    put32(4, rf64 ? 0xFFFFFFFFu : (uint32_t)riffBytes);
+    memcpy(out + 8, "WAVE", 4);
+    memcpy(out + 12, rf64 ? "ds64" : "JUNK", 4);
+    put32(16, 28);
+    if(rf64) {
+        put64(20, riffBytes);
+        put64(28, dataBytes);
+        put64(36, dataBytes / (channels * sizeof(float)));
+        // Chunk size table length at 44 stays 0
+    }
+    memcpy(out + 48, "fmt ", 4);
+    put32(52, 16);
+    put16(56, 3);                   // WAVE_FORMAT_IEEE_FLOAT
+    put16(58, (uint16_t)channels);
+    put32(60, sampleRate);
+    put32(64, (uint32_t)(sampleRate * channels * sizeof(float)));
+    put16(68, (uint16_t)(channels * sizeof(float)));
+    put16(70, 32);
+    memcpy(out + 72, "data", 4);
+    put32(76, rf64 ? 0xFFFFFFFFu : (uint32_t)dataBytes);
+}
+
+// Batched file output for the recorder's writer thread. Bytes collect in an
+// aligned staging buffer and reach the file in writes of RECORD_WRITE_BYTES.
+// With O_DIRECT every write must be whole aligned blocks, so the tail is
+// padded when the file is finished and truncated back afterwards.
+#define RECORD_WRITE_BYTES (1 << 20)
+#define RECORD_DIRECT_ALIGN 4096
+
+struct DiskWriter {
+    int fd;
+    bool direct;       // Page cache bypassed
+    uint8_t* staging;
+    size_t staged;
+    uint64_t offset;   // File offset of staging[0]
+    uint64_t writes;
+    std::string error;
+    
+    DiskWriter() : fd(-1), direct(false), staging(nullptr), staged(0), offset(0), writes(0) {}
+    ~DiskWriter() {
+        if(fd >= 0) ::close(fd);
+        free(staging);
+    }
+    
+    // Falls back to buffered writes if the filesystem refuses O_DIRECT
+    bool open(const std::string& path, bool wantDirect) {
+        if(!staging && posix_memalign((void**)&staging, RECORD_DIRECT_ALIGN, RECORD_WRITE_BYTES + RECORD_DIRECT_ALIGN) != 0) {
+            staging = nullptr;
+            error = "Out of memory for the recording buffer";
+            return false;
+        }
+        staged = 0;
+        offset = 0;
+        writes = 0;
+        direct = false;
+#ifdef O_DIRECT
+        if(wantDirect) {
+            fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+            direct = fd >= 0;
+        }
+#endif
+        if(fd < 0) fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0) {
+            error = "Can't open " + path + ": " + strerror(errno);
+            return false;
+        }
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+        if(wantDirect) fcntl(fd, F_NOCACHE, 1); // macOS: uncached, without O_DIRECT's alignment rules
+#endif
+        return true;
+    }
+    
+    bool append(const void* bytes, size_t count) {
+        const uint8_t* in = (const uint8_t*)bytes;
+        while(count > 0) {
+            size_t n = std::min(count, RECORD_WRITE_BYTES + RECORD_DIRECT_ALIGN - staged);
+            memcpy(staging + staged, in, n);
+            staged += n;
+            in += n;
+            count -= n;
+            if(staged >= RECORD_WRITE_BYTES && !flush(false)) return false;
+        }
+        return true;
+    }
+    
+    // Writes out the tail, then puts the header at the start of the file
+    bool finish(const void* header, size_t headerBytes) {
+        const uint64_t length = offset + staged;
+        bool ok = flush(true);
+        if(ok && direct) {
+            ok = ftruncate(fd, (off_t)length) == 0;
+#ifdef O_DIRECT
+            // The header rewrite is small and unaligned
+            ok = ok && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT) == 0;
+#endif
+            if(!ok) error = std::string("Can't finish the recording: ") + strerror(errno);
+        }
+        ok = ok && writeAll(header, headerBytes, 0);
+        if(::close(fd) != 0 && ok) {
+            error = std::string("Can't close the recording: ") + strerror(errno);
+            ok = false;
+        }
+        fd = -1;
+        return ok;
+    }
+    
+private:
+    bool writeAll(const void* bytes, size_t count, uint64_t position) {
+        const uint8_t* in = (const uint8_t*)bytes;
+        while(count > 0) {
+            ssize_t n = pwrite(fd, in, count, (off_t)position);
+            if(n < 0 && errno == EINTR) continue;
+            if(n <= 0) {
+                error = std::string("Write failed: ") + (n < 0 ? strerror(errno) : "disk full");
+                return false;
+            }
+            in += n;
+            count -= (size_t)n;
+            position += (uint64_t)n;
+        }
+        writes++;
+        return true;
+    }
+    
+    bool flush(bool final) {
+        size_t count = staged;
+        if(direct) {
+            const size_t mask = RECORD_DIRECT_ALIGN - 1;
+            count = final ? (staged + mask) & ~mask : staged & ~mask;
+            memset(staging + staged, 0, count - std::min(count, staged));
+        }
+        if(count == 0) return true;
+        if(!writeAll(staging, count, offset)) return false;
+        size_t kept = staged > count ? staged - count : 0;
+        memmove(staging, staging + count, kept);
+        offset += count;
+        staged = kept;
+        return true;
+    }
+};
+
+// 32-bit float WAV output through a DiskWriter, for the recorder, the offline
+// render and the null backend. The header written at the start only reserves
+// its place; the one from header() replaces it when the file is finished.
+struct WavWriter {
+    uint32_t sampleRate;
+    int channels;
+    uint64_t frames;
+    
+    WavWriter() : sampleRate(0), channels(0), frames(0) {}
+    
+    bool start(uint32_t rate, int channelCount, DiskWriter& disk) {
+        sampleRate = rate;
+        channels = channelCount;
+        frames = 0;
+        uint8_t placeholder[WAV_HEADER_BYTES];
+        header(placeholder);
+        return disk.append(placeholder, WAV_HEADER_BYTES);
+    }
+    
+    bool write(const float* in, size_t frameCount, DiskWriter& disk) {
+        if(!disk.append(in, frameCount * channels * sizeof(float))) return false;
+        frames += frameCount;
+        return true;
+    }
+    
+    void header(uint8_t* out) const {
+        buildWavHeader(out, sampleRate, channels, frames * channels * sizeof(float));
+    }
+};
+
+// FLAC recording (--record FILE.flac), with our own encoder rather than a
+// libFLAC dependency. It does what libFLAC's fast presets do: fixed
+// predictors of order 0-4, the best of left/right, left/side, right/side and
+// mid/side per frame, and partitioned Rice coding of the residual. Blocks are
+// encoded in batches, one block per job, on the writer thread plus
+// --record-threads helpers, and written in order.
+#define FLAC_BLOCK_FRAMES 4096
+#define FLAC_BITS 24              // Recorded resolution; the float engine output is rounded to it
+#define FLAC_MAX_CHANNELS 8
+#define FLAC_MAX_ORDER 4
+#define FLAC_MAX_PARTITION_ORDER 8
+#define FLAC_BATCH_BLOCKS 2       // Blocks per thread per batch
+#define FLAC_HEADER_BYTES 42      // "fLaC" and the STREAMINFO block
+#define MAX_ENCODER_THREADS 8
+
+// MSB-first bit packing for one frame
+struct BitWriter {
+    std::vector<uint8_t> bytes;
+    uint64_t accumulator;
+    int count;                    // Bits in the accumulator not yet in bytes, always < 8
+    
+    BitWriter() : accumulator(0), count(0) {}
+    
+    void reset() {
+        bytes.clear();
+        accumulator = 0;
+        count = 0;
+    }
+    
+    void put(uint32_t value, int bits) {
+        if(bits == 0) return;
+        accumulator = (accumulator << bits) | (value & (0xFFFFFFFFu >> (32 - bits)));
+        count += bits;
+        while(count >= 8) {
+            count -= 8;
+            bytes.push_back((uint8_t)(accumulator >> count));
+        }
+    }
+    
+    void zeros(uint32_t bits) {
+        for(; bits >= 32; bits -= 32) put(0, 32);
+        put(0, (int)bits);
+    }
+    
+    // Zig-zag folded, quotient in unary, then k low bits
+    void rice(int32_t value, int k) {
+        uint32_t folded = ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+        uint32_t quotient = folded >> k;
+        uint32_t low = folded & ((1u << k) - 1);
+        if(quotient + 1 + k <= 32) {
+            put((1u << k) | low, (int)quotient + 1 + k);
+        } else {
+            zeros(quotient);
+            put(1, 1);
+            put(low, k);
+        }
+    }
+    
+    void alignToByte() {
+        if(count) put(0, 8 - count);
+    }
+};
+
+static uint8_t flacCrc8(const uint8_t* bytes, size_t count) {
+    uint8_t crc = 0;
+    for(size_t i = 0; i < count; i++) {
+        crc ^= bytes[i];
+        for(int bit = 0; bit < 8; bit++) crc = (uint8_t)((crc << 1) ^ (crc & 0x80 ? 0x07 : 0));
+    }
+    return crc;
+}
+
+struct Crc16Table {
+    uint16_t entries[256];
+    
+    Crc16Table() {
+        for(int i = 0; i < 256; i++) {
+            uint16_t crc = (uint16_t)(i << 8);
+            for(int bit = 0; bit < 8; bit++) crc = (uint16_t)((crc << 1) ^ (crc & 0x8000 ? 0x8005 : 0));
+            entries[i] = crc;
+        }
+    }
+};
+
+static uint16_t flacCrc16(const uint8_t* bytes, size_t count) {
+    // Built on first use; the encoder threads may get here at the same time,
+    // which a static's initialization is safe against
+    static const Crc16Table table;
+    uint16_t crc = 0;
+    for(size_t i = 0; i < count; i++) crc = (uint16_t)((crc << 8) ^ table.entries[(crc >> 8) ^ bytes[i]]);
+    return crc;
+}
+
+// Residual of the fixed predictor of each order, summed as magnitudes so the
+// cheapest order can be picked before anything is encoded
+static int bestFixedOrder(const int32_t* x, int frames, uint64_t* cost = nullptr) {
+    if(frames <= FLAC_MAX_ORDER) {
+        if(cost) {
+            *cost = 0;
+            for(int i = 0; i < frames; i++) *cost += (uint64_t)std::llabs(x[i]);
+        }
+        return 0;
+    }
+    uint64_t sums[FLAC_MAX_ORDER + 1] = {};
+    int64_t e1 = x[3] - x[2], e2 = e1 - (x[2] - x[1]), e3 = e2 - ((x[2] - x[1]) - (x[1] - x[0]));
+    for(int i = FLAC_MAX_ORDER; i < frames; i++) {
+        int64_t e0 = x[i];
+        int64_t n1 = e0 - x[i - 1];
+        int64_t n2 = n1 - e1;
+        int64_t n3 = n2 - e2;
+        int64_t n4 = n3 - e3;
+        sums[0] += (uint64_t)std::llabs(e0);
+        sums[1] += (uint64_t)std::llabs(n1);
+        sums[2] += (uint64_t)std::llabs(n2);
+        sums[3] += (uint64_t)std::llabs(n3);
+        sums[4] += (uint64_t)std::llabs(n4);
+        e1 = n1;
+        e2 = n2;
+        e3 = n3;
+    }
+    int order = (int)(std::min_element(sums, sums + FLAC_MAX_ORDER + 1) - sums);
+    if(cost) *cost = sums[order];
+    return order;
+}
+
+static void fixedResidual(const int32_t* x, int frames, int order, int32_t* residual) {
+    for(int i = order; i < frames; i++) {
+        switch(order) {
+            case 0: residual[i] = x[i]; break;
+            case 1: residual[i] = x[i] - x[i - 1]; break;
+            case 2: residual[i] = x[i] - 2 * x[i - 1] + x[i - 2]; break;
+            case 3: residual[i] = x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3]; break;
+            default: residual[i] = x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4]; break;
+        }
+    }
+}
+
+// Rice coding plan for one residual: partition order and a parameter per
+// partition, chosen by estimated size
+struct RicePlan {
+    int partitionOrder;
+    int parameters[1 << FLAC_MAX_PARTITION_ORDER];
+    int parameterBits;            // 4 normally, 5 (RICE2) when a parameter exceeds 14
+    uint64_t bits;
+};
+
+static void planRice(const int32_t* residual, int frames, int order, RicePlan& plan,
+                     std::vector<uint64_t>& sums) {
+    int maxOrder = 0;
+    while(maxOrder < FLAC_MAX_PARTITION_ORDER && (frames % (2 << maxOrder)) == 0 &&
+          (frames >> (maxOrder + 1)) > order) {
+        maxOrder++;
+    }
+    // Folded magnitude sums at the finest partitioning, merged pairwise for coarser ones
+    int partitions = 1 << maxOrder;
+    int size = frames >> maxOrder;
+    sums.assign(partitions, 0);
+    for(int p = 0; p < partitions; p++) {
+        for(int i = std::max(p * size, order); i < (p + 1) * size; i++) {
+            sums[p] += ((uint32_t)residual[i] << 1) ^ (uint32_t)(residual[i] >> 31);
+        }
+    }
+    plan.bits = UINT64_MAX;
+    int parameters[1 << FLAC_MAX_PARTITION_ORDER];
+    for(int partitionOrder = maxOrder; partitionOrder >= 0; partitionOrder--) {
+        int count = 1 << partitionOrder;
+        uint64_t bits = 0;
+        int widest = 0;
+        for(int p = 0; p < count; p++) {
+            uint64_t n = (uint64_t)(frames >> partitionOrder) - (p == 0 ? order : 0);
+            uint64_t best = UINT64_MAX;
+            for(int k = 0; k <= 30; k++) {
+                uint64_t cost = n * (k + 1) + (sums[p] >> k);
+                if(cost < best) {
+                    best = cost;
+                    parameters[p] = k;
+                }
+                if((sums[p] >> (k + 1)) < n) break; // A wider parameter no longer pays
+            }
+            bits += best;
+            widest = std::max(widest, parameters[p]);
+        }
+        int parameterBits = widest > 14 ? 5 : 4;
+        bits += (uint64_t)count * parameterBits;
+        if(bits < plan.bits) {
+            plan.bits = bits;
+            plan.partitionOrder = partitionOrder;
+            plan.parameterBits = parameterBits;
+            std::copy(parameters, parameters + count, plan.parameters);
+        }
+        for(int p = 0; p < count / 2; p++) sums[p] = sums[2 * p] + sums[2 * p + 1];
+    }
+}
+
+// Encodes one block into a complete FLAC frame. One per thread; the vectors
+// are reused from block to block.
+struct FlacFrameEncoder {
+    BitWriter bits;
+    std::vector<int32_t> mid, side, residual;
+    std::vector<uint64_t> sums;
+    
+    void encode(const int32_t* const* channels, int channelCount, int frames, uint64_t frameNumber,
+                std::vector<uint8_t>& out) {
+        bits.reset();
+        bits.bytes.reserve((size_t)frames * channelCount * 4);
+        
+        // Stereo: pick the pair that predicts best
+        const int32_t* sources[2] = {channels[0], channelCount > 1 ? channels[1] : nullptr};
+        int assignment = channelCount - 1;
+        int extraBits[2] = {0, 0};
+        if(channelCount == 2) {
+            mid.resize(frames);
+            side.resize(frames);
+            for(int i = 0; i < frames; i++) {
+                side[i] = channels[0][i] - channels[1][i];
+                mid[i] = (channels[0][i] + channels[1][i]) >> 1;
+            }
+            uint64_t cost[4];
+            const int32_t* candidates[4] = {channels[0], channels[1], mid.data(), side.data()};
+            for(int c = 0; c < 4; c++) bestFixedOrder(candidates[c], frames, &cost[c]);
+            uint64_t pairs[4] = {cost[0] + cost[1], cost[0] + cost[3], cost[3] + cost[1], cost[2] + cost[3]};
+            int best = (int)(std::min_element(pairs, pairs + 4) - pairs);
+            if(best == 1) { assignment = 8; sources[1] = side.data(); extraBits[1] = 1; }
+            if(best == 2) { assignment = 9; sources[0] = side.data(); extraBits[0] = 1; }
+            if(best == 3) { assignment = 10; sources[0] = mid.data(); sources[1] = side.data(); extraBits[1] = 1; }
+        }
+        
+        // Frame header; sample rate comes from STREAMINFO
+        bits.put(0x3FFE, 14);
+        bits.put(0, 2);                       // Reserved, fixed block size
+        int sizeCode = frames == FLAC_BLOCK_FRAMES ? 12 : frames <= 256 ? 6 : 7;
+        bits.put(sizeCode, 4);
+        bits.put(0, 4);
+        bits.put(assignment, 4);
+        bits.put(FLAC_BITS == 24 ? 6 : 4, 3);
+        bits.put(0, 1);
+        putUtf8(frameNumber);
+        if(sizeCode == 6) bits.put(frames - 1, 8);
+        if(sizeCode == 7) bits.put(frames - 1, 16);
+        bits.put(flacCrc8(bits.bytes.data(), bits.bytes.size()), 8);
+        
+        for(int c = 0; c < channelCount; c++) {
+            encodeSubframe(c < 2 ? sources[c] : channels[c], frames, FLAC_BITS + (c < 2 ? extraBits[c] : 0));
+        }
+        bits.alignToByte();
+        bits.put(flacCrc16(bits.bytes.data(), bits.bytes.size()), 16);
+        out.swap(bits.bytes);
+    }
+    
+private:
+    void putUtf8(uint64_t value) {
+        if(value < 0x80) {
+            bits.put((uint32_t)value, 8);
+            return;
+        }
+        int continuation = 1;
+        while(value >= (1ull << (5 * continuation + 6))) continuation++;
+        bits.put((0xFF00u >> (continuation + 1)) | (uint32_t)(value >> (6 * continuation)), 8);
+        for(int i = continuation - 1; i >= 0; i--) bits.put(0x80 | ((value >> (6 * i)) & 0x3F), 8);
+    }
+    
+    void encodeSubframe(const int32_t* x, int frames, int sampleBits) {
+        if(std::all_of(x, x + frames, [&](int32_t v) { return v == x[0]; })) {
+            bits.put(0, 8);                   // CONSTANT
+            bits.put((uint32_t)x[0], sampleBits);
+            return;
+        }
+        int order = bestFixedOrder(x, frames);
+        residual.resize(frames);
+        fixedResidual(x, frames, order, residual.data());
+        RicePlan plan;
+        planRice(residual.data(), frames, order, plan, sums);
+        if(order * sampleBits + 6 + plan.bits >= (uint64_t)frames * sampleBits) {
+            bits.put(0x02, 8);                // VERBATIM
+            for(int i = 0; i < frames; i++) bits.put((uint32_t)x[i], sampleBits);
+            return;
+        }
+        bits.put((0x08 | order) << 1, 8);     // FIXED
+        for(int i = 0; i < order; i++) bits.put((uint32_t)x[i], sampleBits);
+        bits.put(plan.parameterBits == 5 ? 1 : 0, 2);
+        bits.put(plan.partitionOrder, 4);
+        int count = 1 << plan.partitionOrder;
+        int size = frames >> plan.partitionOrder;
+        for(int p = 0; p < count; p++) {
+            int k = plan.parameters[p];
+            bits.put(k, plan.parameterBits);
+            for(int i = std::max(p * size, order); i < (p + 1) * size; i++) bits.rice(residual[i], k);
+        }
+    }
+};
+
+// Streaming FLAC encoder. The writer thread feeds it float frames; every
+// full batch is encoded in parallel and appended to the file.
+struct FlacEncoder {
+    int channels;
+    uint32_t sampleRate;
+    int batchBlocks;
+    std::vector<int32_t> pending;         // [channel][batchBlocks * FLAC_BLOCK_FRAMES]
+    size_t pendingFrames;
+    uint64_t framesEncoded;
+    uint64_t blocksEncoded;
+    uint32_t minFrameBytes, maxFrameBytes;
+    std::vector<std::vector<uint8_t>> encoded; // One frame per block of the batch
+    std::vector<FlacFrameEncoder> encoders;    // [0] is the writer thread's
+    
+    std::vector<std::thread> threads;
+    std::mutex jobMutex;
+    std::condition_variable jobReady, jobDone;
+    uint64_t generation;
+    int blocksInJob, nextBlock, blocksDone;
+    size_t lastBlockFrames;
+    bool running;
+    
+    FlacEncoder() : channels(0), sampleRate(0), batchBlocks(0), pendingFrames(0), framesEncoded(0),
+                    blocksEncoded(0), minFrameBytes(0), maxFrameBytes(0), generation(0), blocksInJob(0),
+                    nextBlock(0), blocksDone(0), lastBlockFrames(0), running(false) {}
+    ~FlacEncoder() { stop(); }
+    
+    void start(double rate, int channelCount, int helpers) {
+        channels = std::min(channelCount, FLAC_MAX_CHANNELS);
+        sampleRate = (uint32_t)lround(rate);
+        helpers = std::max(0, std::min(MAX_ENCODER_THREADS, helpers));
+        batchBlocks = (helpers + 1) * FLAC_BATCH_BLOCKS;
+        pending.assign((size_t)channels * batchBlocks * FLAC_BLOCK_FRAMES, 0);
+        pendingFrames = 0;
+        framesEncoded = 0;
+        blocksEncoded = 0;
+        minFrameBytes = UINT32_MAX;
+        maxFrameBytes = 0;
+        encoded.assign(batchBlocks, std::vector<uint8_t>());
+        encoders.assign(helpers + 1, FlacFrameEncoder());
+        running = true;
+        for(int i = 1; i <= helpers; i++) threads.emplace_back(&FlacEncoder::workerLoop, this, i);
+    }
+    
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            if(!running) return;
+            running = false;
+        }
+        jobReady.notify_all();
+        for(auto& thread : threads) thread.join();
+        threads.clear();
+    }
+    
+    bool write(const float* in, size_t frames, DiskWriter& disk) {
+        const size_t capacity = (size_t)batchBlocks * FLAC_BLOCK_FRAMES;
+        while(frames > 0) {
+            size_t n = std::min(frames, capacity - pendingFrames);
+            for(int c = 0; c < channels; c++) {
+                int32_t* out = &pending[c * capacity + pendingFrames];
+                for(size_t i = 0; i < n; i++) out[i] = toSample(in[i * channels + c]);
+            }
+            pendingFrames += n;
+            in += n * channels;
+            frames -= n;
+            if(pendingFrames == capacity && !encodePending(disk)) return false;
+        }
+        return true;
+    }
+    
+    // Encodes what is left, the last block short if need be
+    bool finish(DiskWriter& disk) {
+        return encodePending(disk);
+    }
+    
+    void header(uint8_t* out) const {
+        memcpy(out, "fLaC", 4);
+        out[4] = 0x80;                        // Last metadata block, STREAMINFO
+        out[5] = 0;
+        out[6] = 0;
+        out[7] = 34;
+        BitWriter info;
+        info.put(FLAC_BLOCK_FRAMES, 16);
+        info.put(FLAC_BLOCK_FRAMES, 16);
+        info.put(blocksEncoded ? minFrameBytes : 0, 24);
+        info.put(maxFrameBytes, 24);
+        info.put(sampleRate, 20);
+        info.put(channels - 1, 3);
+        info.put(FLAC_BITS - 1, 5);
+        info.put((uint32_t)(framesEncoded >> 32) & 0xF, 4);
+        info.put((uint32_t)framesEncoded, 32);
+        memcpy(out + 8, info.bytes.data(), 18);
+        memset(out + 26, 0, 16);              // No MD5
+    }
+    
+private:
+    static int32_t toSample(float x) {
+        const float scale = (float)(1 << (FLAC_BITS - 1));
+        return (int32_t)lrintf(std::max(-scale, std::min(scale - 1.0f, x * scale)));
+    }
+    
+    bool encodePending(DiskWriter& disk) {
+        if(pendingFrames == 0) return true;
+        int blocks = (int)((pendingFrames + FLAC_BLOCK_FRAMES - 1) / FLAC_BLOCK_FRAMES);
+        lastBlockFrames = pendingFrames - (size_t)(blocks - 1) * FLAC_BLOCK_FRAMES;
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            blocksInJob = blocks;
+            nextBlock = 0;
+            blocksDone = 0;
+            generation++;
+        }
+        jobReady.notify_all();
+        encodeBlocks(0);
+        {
+            std::unique_lock<std::mutex> lock(jobMutex);
+            jobDone.wait(lock, [&] { return blocksDone == blocksInJob; });
+        }
+        bool ok = true;
+        for(int b = 0; b < blocks && ok; b++) {
+            uint32_t bytes = (uint32_t)encoded[b].size();
+            minFrameBytes = std::min(minFrameBytes, bytes);
+            maxFrameBytes = std::max(maxFrameBytes, bytes);
+            ok = disk.append(encoded[b].data(), bytes);
+        }
+        framesEncoded += pendingFrames;
+        blocksEncoded += blocks;
+        pendingFrames = 0;
+        return ok;
+    }
+    
+    // Claims blocks of the current job until none are left
+    void encodeBlocks(int encoder) {
+        const size_t capacity = (size_t)batchBlocks * FLAC_BLOCK_FRAMES;
+        for(;;) {
+            int block;
+            {
+                std::lock_guard<std::mutex> lock(jobMutex);
+                if(nextBlock >= blocksInJob) return;
+                block = nextBlock++;
+            }
+            const int32_t* sources[FLAC_MAX_CHANNELS];
+            for(int c = 0; c < channels; c++) sources[c] = &pending[c * capacity + (size_t)block * FLAC_BLOCK_FRAMES];
+            int frames = block == blocksInJob - 1 ? (int)lastBlockFrames : FLAC_BLOCK_FRAMES;
+            encoders[encoder].encode(sources, channels, frames, blocksEncoded + block, encoded[block]);
+            {
+                std::lock_guard<std::mutex> lock(jobMutex);
+                if(++blocksDone == blocksInJob) jobDone.notify_one();
+            }
+        }
+    }
+    
+    void workerLoop(int encoder) {
+        uint64_t seen = 0;
+        for(;;) {
+            {
+                std::unique_lock<std::mutex> lock(jobMutex);
+                jobReady.wait(lock, [&] { return !running || generation != seen; });
+                if(!running) return;
+                seen = generation;
+            }
+            encodeBlocks(encoder);
+        }
+    }
+};
+
+// Disk recorder (--record FILE.wav or FILE.flac). The engine copies every
+// rendered block into a preallocated ring and never waits; a writer thread at
+// normal priority drains the ring to disk, through the FLAC encoder if the
+// file name asks for it. If the disk stalls for longer than the ring holds,
+// whole blocks are dropped and counted instead of the audio glitching.
+#define RECORD_RING_SECONDS 8
+#define RECORD_POLL_MS 50
+#define RECORD_CHUNK_FRAMES 8192
+
+struct Recorder {
+    AudioFifo ring;
+    DiskWriter disk;
+    WavWriter wav;
+    FlacEncoder flac;
+    bool flacOutput;
+    std::string path;
+    uint32_t sampleRate;
+    std::vector<float> chunk;
+    std::thread thread;
+    std::atomic<bool> running;
+    std::atomic<bool> failed;            // Disk error; the ring is drained and discarded from then on
+    std::atomic<uint64_t> droppedBlocks; // Blocks the ring had no room for
+    std::atomic<uint64_t> droppedFrames;
+    std::atomic<size_t> peakFill;        // Most frames ever waiting in the ring
+    uint64_t framesWritten;              // Writer thread; read after stop()
+    
+    Recorder() : flacOutput(false), sampleRate(0), running(false), failed(false), droppedBlocks(0), droppedFrames(0),
+                 peakFill(0), framesWritten(0) {}
+    ~Recorder() { stop(); }
+    
+    // Main thread, before the recorder is handed to the engine
+    bool start(const std::string& file, double rate, int channels, bool direct, int encoderThreads) {
+        if(!disk.open(file, direct)) return false;
+        path = file;
+        sampleRate = (uint32_t)lround(rate);
+        ring.reset((size_t)(RECORD_RING_SECONDS * rate), channels);
+        chunk.assign((size_t)RECORD_CHUNK_FRAMES * channels, 0.0f);
+        // The header goes in now to reserve its place; it is rewritten at the end
+        flacOutput = file.size() > 5 && strcasecmp(file.c_str() + file.size() - 5, ".flac") == 0;
+        uint8_t header[std::max(WAV_HEADER_BYTES, FLAC_HEADER_BYTES)];
+        if(flacOutput) {
+            flac.start(rate, channels, encoderThreads);
+            flac.header(header);
+            disk.append(header, FLAC_HEADER_BYTES);
+        } else {
+            wav.start(sampleRate, channels, disk);
+        }
+        framesWritten = 0;
+        running = true;
+        thread = std::thread(&Recorder::loop, this);
+        return true;
+    }
+    
+    // Engine thread: a copy into the ring, or a count if it doesn't fit
+    void push(const float* in, unsigned long frames) {
+        if(ring.writable() < frames) {
+            droppedBlocks.fetch_add(1, std::memory_order_relaxed);
+            droppedFrames.fetch_add(frames, std::memory_order_relaxed);
+            return;
+        }
+        ring.write(in, frames);
+    }
+    
+    // Main thread, once the engine no longer sees the recorder. Writes out
+    // what is left and finishes the file.
+    bool stop() {
+        if(!running.exchange(false)) return false;
+        thread.join();
+        drain();
+        bool finished;
+        if(flacOutput) {
+            if(!failed && !flac.finish(disk)) failed = true;
+            flac.stop();
+            uint8_t header[FLAC_HEADER_BYTES];
+            flac.header(header);
+            finished = disk.finish(header, sizeof(header));
+        } else {
+            uint8_t header[WAV_HEADER_BYTES];
+            wav.header(header);
+            finished = disk.finish(header, sizeof(header));
+        }
+        return finished && !failed;
+    }
+    
+    // Size on disk over the same audio as a float WAV
+    double compression() const {
+        double raw = (double)framesWritten * ring.channels * sizeof(float);
+        return raw > 0.0 ? (double)(disk.offset + disk.staged) / raw : 1.0;
+    }
+    
+    double seconds() const { return sampleRate ? (double)framesWritten / sampleRate : 0.0; }
+    
+private:
+    void drain() {
+        size_t waiting = ring.readable();
+        if(waiting > peakFill.load(std::memory_order_relaxed)) peakFill.store(waiting, std::memory_order_relaxed);
+        while(size_t frames = ring.read(chunk.data(), RECORD_CHUNK_FRAMES)) {
+            if(failed.load(std::memory_order_relaxed)) continue;
+            bool written = flacOutput ? flac.write(chunk.data(), frames, disk) : wav.write(chunk.data(), frames, disk);
+            if(written) {
+                framesWritten += frames;
+            } else {
+                failed.store(true, std::memory_order_relaxed);
+            }
+        }
+    }
+    
+    void loop() {
+        while(running.load(std::memory_order_relaxed)) {
+            drain();
+            std::this_thread::sleep_for(std::chrono::milliseconds(RECORD_POLL_MS));
+        }
+    }
+};
+
+static void recordBlock(Recorder* recorder, const float* in, unsigned long frames) {
+    recorder->push(in, frames);
+}
+
+// Renders interleaved float frames; the engine's side of every backend
+typedef void (*AudioRenderFn)(float* out, unsigned long frames, const AudioCallbackInfo& info, void* user);
+
+// Device sample formats. The engine always renders float; when the device
+// wants integers we convert ourselves, with TPDF dither for 16 and 24 bits,
+// rather than let PortAudio or ALSA plug insert a conversion pass we can't see.
+enum SampleFormat { FORMAT_AUTO = -1, FORMAT_FLOAT32, FORMAT_INT16, FORMAT_INT24, FORMAT_INT32, FORMAT_COUNT };
+static const char* const sampleFormatNames[FORMAT_COUNT] = {"f32", "s16", "s24", "s32"};
+static const int sampleFormatBytes[FORMAT_COUNT] = {4, 2, 3, 4}; // s24 is packed little-endian
+
+#define MAX_CONVERT_FRAMES 4096 // Scratch size; longer buffers are converted in pieces
+#define MAX_OUTPUT_CHANNELS 8
+
+// Float to integer sample conversion. Full scale maps to the largest
+// positive integer; s32 stops just short, at the largest float below 2^31.
+// Dither is two uniform draws subtracted, a triangular spread of +-1 LSB,
+// from four xorshift generators running side by side.
+struct SampleConverter {
+    int format;
+    bool dither;
+    alignas(16) uint32_t rng[4];
+    
+    SampleConverter() : format(FORMAT_FLOAT32), dither(true), rng{0x9E3779B9u, 0x7F4A7C15u, 0x94D049BBu, 0x2545F491u} {}
+    
+    // Contiguous floats to contiguous device samples
+    void convert(const float* in, void* out, size_t count) {
+        switch(format) {
+            case FORMAT_INT16: toInt16(in, (int16_t*)out, count); break;
+            case FORMAT_INT24: toInt24(in, (uint8_t*)out, count); break;
+            case FORMAT_INT32: toInt32(in, (int32_t*)out, count); break;
+            default: memcpy(out, in, count * sizeof(float)); break;
+        }
+    }
+    
+private:
+    uint32_t nextRandom(int lane) {
+        uint32_t x = rng[lane];
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        return rng[lane] = x;
+    }
+    
+    // Triangular noise in (-1, 1), in units of the target LSB
+    float triangular() {
+        const float unit = 1.0f / 4294967296.0f;
+        return dither ? (nextRandom(0) * unit - nextRandom(1) * unit) : 0.0f;
+    }
+    
+    int32_t quantize(float sample, float scale, float limit) {
+        float v = sample * scale + triangular();
+        return (int32_t)lrintf(std::max(-limit, std::min(limit, v)));
+    }
+    
+    // The SIMD generator state lives in a register for the length of a loop
+#if defined(WAVE_SIMD_SSE2)
+    typedef __m128i RandomLanes;
+    RandomLanes loadRandom() const { return _mm_load_si128((const __m128i*)rng); }
+    void storeRandom(RandomLanes x) { _mm_store_si128((__m128i*)rng, x); }
+    
+    __m128 triangular4(__m128i& x) {
+        if(!dither) return _mm_setzero_ps();
+        x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+        x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+        x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+        __m128i first = x;
+        x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+        x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+        x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+        // Top 24 bits of each draw as a uniform [0, 1), exact in a float
+        const __m128 unit = _mm_set1_ps(1.0f / 16777216.0f);
+        __m128 u1 = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(first, 8)), unit);
+        __m128 u2 = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(x, 8)), unit);
+        return _mm_sub_ps(u1, u2);
+    }
+    
+    __m128i quantize4(const float* in, __m128 scale, __m128 limit, RandomLanes& random) {
+        __m128 v = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(in), scale), triangular4(random));
+        v = _mm_max_ps(_mm_sub_ps(_mm_setzero_ps(), limit), _mm_min_ps(limit, v));
+        return _mm_cvtps_epi32(v); // Rounds to nearest
+    }
+#elif defined(WAVE_SIMD_NEON)
+    typedef uint32x4_t RandomLanes;
+    RandomLanes loadRandom() const { return vld1q_u32(rng); }
+    void storeRandom(RandomLanes x) { vst1q_u32(rng, x); }
+    
+    float32x4_t triangular4(uint32x4_t& x) {
+        if(!dither) return vdupq_n_f32(0.0f);
+        x = veorq_u32(x, vshlq_n_u32(x, 13));
+        x = veorq_u32(x, vshrq_n_u32(x, 17));
+        x = veorq_u32(x, vshlq_n_u32(x, 5));
+        uint32x4_t first = x;
+        x = veorq_u32(x, vshlq_n_u32(x, 13));
+        x = veorq_u32(x, vshrq_n_u32(x, 17));
+        x = veorq_u32(x, vshlq_n_u32(x, 5));
+        const float unit = 1.0f / 16777216.0f;
+        return vmulq_n_f32(vsubq_f32(vcvtq_f32_u32(vshrq_n_u32(first, 8)), vcvtq_f32_u32(vshrq_n_u32(x, 8))), unit);
+    }
+    
+    int32x4_t quantize4(const float* in, float scale, float limit, RandomLanes& random) {
+        float32x4_t v = vmlaq_n_f32(triangular4(random), vld1q_f32(in), scale);
+        v = vmaxq_f32(vdupq_n_f32(-limit), vminq_f32(vdupq_n_f32(limit), v));
+        // Round half away from zero; the dither makes the tie rule irrelevant
+        uint32x4_t negative = vcltq_f32(v, vdupq_n_f32(0.0f));
+        float32x4_t half = vbslq_f32(negative, vdupq_n_f32(-0.5f), vdupq_n_f32(0.5f));
+        return vcvtq_s32_f32(vaddq_f32(v, half));
+    }
+#endif
+    
+    void toInt16(const float* in, int16_t* out, size_t count) {
+        const float scale = 32767.0f, limit = 32767.0f;
+        size_t i = 0;
+#if defined(WAVE_SIMD_SSE2)
+        const __m128 vScale = _mm_set1_ps(scale), vLimit = _mm_set1_ps(limit);
+        RandomLanes random = loadRandom();
+        for(; i + 8 <= count; i += 8) {
+            __m128i lo = quantize4(in + i, vScale, vLimit, random);
+            __m128i hi = quantize4(in + i + 4, vScale, vLimit, random);
+            _mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi32(lo, hi));
+        }
+        storeRandom(random);
+#elif defined(WAVE_SIMD_NEON)
+        RandomLanes random = loadRandom();
+        for(; i + 8 <= count; i += 8) {
+            int16x4_t lo = vqmovn_s32(quantize4(in + i, scale, limit, random));
+            int16x4_t hi = vqmovn_s32(quantize4(in + i + 4, scale, limit, random));
+            vst1q_s16(out + i, vcombine_s16(lo, hi));
+        }
+        storeRandom(random);
+#endif
+        for(; i < count; i++) out[i] = (int16_t)quantize(in[i], scale, limit);
+    }
+    
+    void toInt24(const float* in, uint8_t* out, size_t count) {
+        const float scale = 8388607.0f, limit = 8388607.0f;
+        size_t i = 0;
+        alignas(16) int32_t values[4];
+#if defined(WAVE_SIMD_SSE2)
+        const __m128 vScale = _mm_set1_ps(scale), vLimit = _mm_set1_ps(limit);
+        RandomLanes random = loadRandom();
+        for(; i + 4 <= count; i += 4) {
+            _mm_store_si128((__m128i*)values, quantize4(in + i, vScale, vLimit, random));
+            for(int k = 0; k < 4; k++) storeInt24(out + 3 * (i + k), values[k]);
+        }
+        storeRandom(random);
+#elif defined(WAVE_SIMD_NEON)
+        RandomLanes random = loadRandom();
+        for(; i + 4 <= count; i += 4) {
+            vst1q_s32(values, quantize4(in + i, scale, limit, random));
+            for(int k = 0; k < 4; k++) storeInt24(out + 3 * (i + k), values[k]);
+        }
+        storeRandom(random);
+#endif
+        (void)values;
+        for(; i < count; i++) storeInt24(out + 3 * i, quantize(in[i], scale, limit));
+    }
+    
+    static void storeInt24(uint8_t* out, int32_t value) {
+        out[0] = (uint8_t)value;
+        out[1] = (uint8_t)(value >> 8);
+        out[2] = (uint8_t)(value >> 16);
+    }
+    
+    // No dither: float has fewer mantissa bits than the output
+    void toInt32(const float* in, int32_t* out, size_t count) {
+        const float scale = 2147483648.0f, limit = 2147483520.0f;
+        bool dithering = dither;
+        dither = false;
+        size_t i = 0;
+#if defined(WAVE_SIMD_SSE2)
+        const __m128 vScale = _mm_set1_ps(scale), vLimit = _mm_set1_ps(limit);
+        RandomLanes random = loadRandom();
+        for(; i + 4 <= count; i += 4) {
+            _mm_storeu_si128((__m128i*)(out + i), quantize4(in + i, vScale, vLimit, random));
+        }
+#elif defined(WAVE_SIMD_NEON)
+        RandomLanes random = loadRandom();
+        for(; i + 4 <= count; i += 4) {
+            vst1q_s32(out + i, quantize4(in + i, scale, limit, random));
+        }
+#endif
+        for(; i < count; i++) out[i] = quantize(in[i], scale, limit);
+        dither = dithering;
+    }
+};
+
+// Split interleaved frames into one contiguous run per channel
+static void deinterleave(const float* in, float* const* out, int channels, size_t frames) {
+    size_t i = 0;
+    if(channels == 2) {
+#if defined(WAVE_SIMD_SSE2)
+        for(; i + 4 <= frames; i += 4) {
+            __m128 a = _mm_loadu_ps(in + 2 * i);
+            __m128 b = _mm_loadu_ps(in + 2 * i + 4);
+            _mm_storeu_ps(out[0] + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+            _mm_storeu_ps(out[1] + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+        }
+#elif defined(WAVE_SIMD_NEON)
+        for(; i + 4 <= frames; i += 4) {
+            float32x4x2_t pair = vld2q_f32(in + 2 * i);
+            vst1q_f32(out[0] + i, pair.val[0]);
+            vst1q_f32(out[1] + i, pair.val[1]);
+        }
+#endif
+    }
+    for(; i < frames; i++) {
+        for(int c = 0; c < channels; c++) out[c][i] = in[i * channels + c];
+    }
+}
+
+// What a backend puts between the engine's interleaved float frames and the
+// device buffer: nothing for interleaved float, otherwise a scratch render,
+// an optional split into channels and a conversion per run of samples.
+struct OutputStage {
+    int format;
+    bool nonInterleaved;
+    int channels;
+    SampleConverter converter;
+    std::vector<float> scratch;  // MAX_CONVERT_FRAMES interleaved frames
+    std::vector<float> planar;   // MAX_CONVERT_FRAMES per channel
+    
+    OutputStage() : format(FORMAT_FLOAT32), nonInterleaved(false), channels(0) {}
+    
+    void configure(int sampleFormat, bool planarOutput, int channelCount, bool dither) {
+        format = sampleFormat;
+        nonInterleaved = planarOutput;
+        channels = channelCount;
+        converter.format = sampleFormat;
+        converter.dither = dither;
+        scratch.assign((size_t)MAX_CONVERT_FRAMES * channels, 0.0f);
+        planar.assign(nonInterleaved ? (size_t)MAX_CONVERT_FRAMES * channels : 0, 0.0f);
+    }
+    
+    bool direct() const { return format == FORMAT_FLOAT32 && !nonInterleaved; }
+    
+    // Interleaved float frames into the device buffer, which is one block of
+    // interleaved samples or, non-interleaved, an array of channel pointers.
+    // offset is in frames.
+    void write(const float* in, void* out, unsigned long offset, unsigned long frames) {
+        const int bytes = sampleFormatBytes[format];
+        if(!nonInterleaved) {
+            converter.convert(in, (char*)out + (size_t)offset * channels * bytes, frames * channels);
+            return;
+        }
+        float* runs[MAX_OUTPUT_CHANNELS];
+        for(int c = 0; c < channels; c++) runs[c] = &planar[(size_t)c * MAX_CONVERT_FRAMES];
+        void* const* outputs = (void* const*)out;
+        for(unsigned long done = 0; done < frames; ) {
+            unsigned long n = std::min<unsigned long>(frames - done, MAX_CONVERT_FRAMES);
+            deinterleave(in + (size_t)done * channels, runs, channels, n);
+            for(int c = 0; c < channels; c++) {
+                converter.convert(runs[c], (char*)outputs[c] + (size_t)(offset + done) * bytes, n);
+            }
+            done += n;
+        }
+    }
+    
+    // Run the engine straight into the device buffer when it takes interleaved
+    // float, otherwise into the scratch a piece at a time
+    void pull(AudioRenderFn render, void* user, AudioCallbackInfo info, double sampleRate,
+              void* out, unsigned long frames) {
+        if(direct()) {
+            render((float*)out, frames, info, user);
+            return;
+        }
+        for(unsigned long done = 0; done < frames; ) {
+            unsigned long n = std::min<unsigned long>(frames - done, MAX_CONVERT_FRAMES);
+            render(scratch.data(), n, info, user);
+            write(scratch.data(), out, done, n);
+            if(info.outputTime > 0.0) info.outputTime += n / sampleRate;
+            done += n;
+        }
+    }
+};
+
+// Audio backends. Each one owns a device (or stands in for one) and calls
+// the render function from its own audio thread, through an OutputStage.
+
+// Suggested latency: seconds, or one of the device's defaults
+#define LATENCY_DEVICE_LOW -1.0
+#define LATENCY_DEVICE_HIGH -2.0
+
+struct AudioBackendConfig {
+    double sampleRate;
+    unsigned long framesPerBuffer; // 0: let the backend choose
+    int channels;
+    double suggestedLatency;
+    int periods;            // ALSA: periods in the device buffer
+    std::string device;     // PortAudio: device name; ALSA: PCM name
+    std::string outputPath; // Null backend: optional WAV file to write
+    int format;             // SampleFormat; FORMAT_AUTO lets the backend pick
+    bool nonInterleaved;
+    bool dither;
+};
+
+struct AudioBackend {
+    AudioBackend() : sampleRate(0.0), framesPerBuffer(0), outputLatency(0.0), format(FORMAT_FLOAT32),
+                     nonInterleaved(false) {}
+    virtual ~AudioBackend() {}
+    virtual const char* name() const = 0;
+    virtual bool open(const AudioBackendConfig& config, AudioRenderFn render, void* user) = 0;
+    virtual bool start() = 0;
+    virtual void stop() = 0;
+    virtual void close() = 0;
+    virtual double time() const = 0; // Clock used for AudioCallbackInfo times
+    
+    // What open() actually negotiated. framesPerBuffer is 0 when the
+    // callback size may vary from call to call.
+    double sampleRate;
+    unsigned long framesPerBuffer;
+    double outputLatency;
+    int format;
+    bool nonInterleaved;
+    std::string error;
+    
+protected:
+    OutputStage stage;
+    
+    void setOutput(int sampleFormat, const AudioBackendConfig& config) {
+        format = sampleFormat;
+        nonInterleaved = config.nonInterleaved;
+        stage.configure(sampleFormat, config.nonInterleaved, config.channels, config.dither);
+    }
+};
+
+static double steadySeconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct PortAudioBackend : AudioBackend {
+    PaStream* stream;
+    bool initialized;
+    AudioRenderFn render;
+    void* user;
+    
+    PortAudioBackend() : stream(nullptr), initialized(false), render(nullptr), user(nullptr) {}
+    ~PortAudioBackend() { close(); }
+    
+    const char* name() const override { return "portaudio"; }
+    
+    bool open(const AudioBackendConfig& config, AudioRenderFn renderFn, void* userData) override {
+        render = renderFn;
+        user = userData;
+        PaError err = Pa_Initialize();
+        if(err != paNoError) return fail(err);
+        initialized = true;
+        
+        PaDeviceIndex device = findDevice(config.device);
+        if(device == paNoDevice) {
+            error = config.device.empty() ? "No default output device" : "No output device named " + config.device;
+            return false;
+        }
+        const PaDeviceInfo* deviceInfo = Pa_GetDeviceInfo(device);
+        std::cout << "Output device: " << deviceInfo->name << " (default latency "
+                  << deviceInfo->defaultLowOutputLatency * 1000.0 << " ms low, "
+                  << deviceInfo->defaultHighOutputLatency * 1000.0 << " ms high, "
+                  << deviceInfo->defaultSampleRate << " Hz)" << std::endl;
+        
+        // PortAudio doesn't say what the hardware takes, so "auto" is float
+        static const PaSampleFormat paFormats[FORMAT_COUNT] = {paFloat32, paInt16, paInt24, paInt32};
+        int sampleFormat = config.format == FORMAT_AUTO ? FORMAT_FLOAT32 : config.format;
+        PaStreamParameters output;
+        output.device = device;
+        output.channelCount = config.channels;
+        output.sampleFormat = paFormats[sampleFormat] | (config.nonInterleaved ? paNonInterleaved : 0);
+        output.suggestedLatency = config.suggestedLatency == LATENCY_DEVICE_HIGH ? deviceInfo->defaultHighOutputLatency
+                                : config.suggestedLatency == LATENCY_DEVICE_LOW ? deviceInfo->defaultLowOutputLatency
+                                : config.suggestedLatency;
+        output.hostApiSpecificStreamInfo = nullptr;
+        err = Pa_IsFormatSupported(nullptr, &output, config.sampleRate);
+        if(err != paNoError) return fail(err);
+        
+        unsigned long frames = config.framesPerBuffer ? config.framesPerBuffer : paFramesPerBufferUnspecified;
+        // Integer output is already dithered and clipped by the time PortAudio sees it
+        PaStreamFlags flags = sampleFormat == FORMAT_FLOAT32 ? paNoFlag : paDitherOff | paClipOff;
+        err = Pa_OpenStream(&stream, nullptr, &output, config.sampleRate, frames, flags, streamCallback, this);
+        if(err != paNoError) {
+            stream = nullptr;
+            return fail(err);
+        }
+        const PaStreamInfo* info = Pa_GetStreamInfo(stream);
+        sampleRate = info ? info->sampleRate : config.sampleRate;
+        framesPerBuffer = config.framesPerBuffer;
+        outputLatency = info ? info->outputLatency : output.suggestedLatency;
+        setOutput(sampleFormat, config);
+        return true;
+    }
+    
+    bool start() override {
+        PaError err = Pa_StartStream(stream);
+        return err == paNoError || fail(err);
+    }
+    
+    void stop() override {
+        if(stream) Pa_StopStream(stream);
+    }
+    
+    void close() override {
+        if(stream) Pa_CloseStream(stream);
+        stream = nullptr;
+        if(initialized) Pa_Terminate();
+        initialized = false;
+    }
+    
+    double time() const override { return stream ? Pa_GetStreamTime(stream) : 0.0; }
+    
+private:
+    bool fail(PaError err) {
+        error = std::string("PortAudio error: ") + Pa_GetErrorText(err);
+        return false;
+    }
+    
+    static PaDeviceIndex findDevice(const std::string& wanted) {
+        if(wanted.empty()) return Pa_GetDefaultOutputDevice();
+        PaDeviceIndex count = Pa_GetDeviceCount();
+        for(PaDeviceIndex i = 0; i < count; i++) {
+            const PaDeviceInfo* info = Pa_GetDeviceInfo(i);
+            if(info && info->maxOutputChannels > 0 && wanted == info->name) return i;
+        }
+        return paNoDevice;
+    }
+    
+    static int streamCallback(const void* inputBuffer, void* outputBuffer,
+                              unsigned long framesPerBuffer,
+                              const PaStreamCallbackTimeInfo* timeInfo,
+                              PaStreamCallbackFlags statusFlags,
+                              void* userData) {
+        (void)inputBuffer;
+        PortAudioBackend* self = (PortAudioBackend*)userData;
+        AudioCallbackInfo info = {timeInfo->currentTime, timeInfo->outputBufferDacTime,
+                                  (statusFlags & paOutputUnderflow) != 0, (statusFlags & paOutputOverflow) != 0};
+        self->stage.pull(self->render, self->user, info, self->sampleRate, outputBuffer, framesPerBuffer);
+        return paContinue;
+    }
+};
+
+#ifdef WAVE_HAVE_ALSA
+// Direct ALSA output in mmap mode: the engine renders straight into the
+// device's ring buffer when it takes interleaved float, otherwise into a
+// scratch period that is converted on the way in. The device is configured
+// for the requested period size and number of periods.
+struct AlsaBackend : AudioBackend {
+    snd_pcm_t* pcm;
+    snd_pcm_format_t pcmFormat;
+    snd_pcm_uframes_t periodFrames;
+    unsigned int rate;
+    int channels;
+    AudioRenderFn render;
+    void* user;
+    std::thread thread;
+    std::atomic<bool> running;
+    
+    AlsaBackend() : pcm(nullptr), pcmFormat(SND_PCM_FORMAT_FLOAT_LE), periodFrames(0), rate(0), channels(0),
+                    render(nullptr), user(nullptr), running(false) {}
+    ~AlsaBackend() { close(); }
+    
+    const char* name() const override { return "alsa"; }
+    
+    bool open(const AudioBackendConfig& config, AudioRenderFn renderFn, void* userData) override {
+        render = renderFn;
+        user = userData;
+        channels = config.channels;
+        const char* device = config.device.empty() ? "default" : config.device.c_str();
+        int err = snd_pcm_open(&pcm, device, SND_PCM_STREAM_PLAYBACK, 0);
+        if(err < 0) {
+            pcm = nullptr;
+            return fail("open", err);
+        }
+        
+        snd_pcm_hw_params_t* hw;
+        snd_pcm_hw_params_malloc(&hw);
+        snd_pcm_hw_params_any(pcm, hw);
+        err = snd_pcm_hw_params_set_access(pcm, hw, config.nonInterleaved ? SND_PCM_ACCESS_MMAP_NONINTERLEAVED
+                                                                          : SND_PCM_ACCESS_MMAP_INTERLEAVED);
+        if(err < 0) {
+            snd_pcm_hw_params_free(hw);
+            return fail(config.nonInterleaved ? "mmap non-interleaved access" : "mmap interleaved access", err);
+        }
+        // Indexed by SampleFormat; "auto" takes the first one the device has in this order
+        static const snd_pcm_format_t pcmFormats[FORMAT_COUNT] = {SND_PCM_FORMAT_FLOAT_LE, SND_PCM_FORMAT_S16_LE,
+                                                                  SND_PCM_FORMAT_S24_3LE, SND_PCM_FORMAT_S32_LE};
+        static const int preferred[] = {FORMAT_FLOAT32, FORMAT_INT32, FORMAT_INT24, FORMAT_INT16};
+        int sampleFormat = FORMAT_AUTO;
+        err = -EINVAL;
+        for(int candidate : preferred) {
+            if(config.format != FORMAT_AUTO && candidate != config.format) continue;
+            if(snd_pcm_hw_params_test_format(pcm, hw, pcmFormats[candidate]) == 0) {
+                sampleFormat = candidate;
+                pcmFormat = pcmFormats[candidate];
+                err = snd_pcm_hw_params_set_format(pcm, hw, pcmFormat);
+                break;
+            }
+        }
+        rate = (unsigned int)config.sampleRate;
+        snd_pcm_uframes_t period = config.framesPerBuffer ? config.framesPerBuffer : DEFAULT_FRAMES_PER_BUFFER;
+        unsigned int periods = (unsigned int)std::max(2, config.periods);
+        if(err >= 0) err = snd_pcm_hw_params_set_channels(pcm, hw, (unsigned int)channels);
+        if(err >= 0) err = snd_pcm_hw_params_set_rate_near(pcm, hw, &rate, nullptr);
+        if(err >= 0) err = snd_pcm_hw_params_set_period_size_near(pcm, hw, &period, nullptr);
+        if(err >= 0) err = snd_pcm_hw_params_set_periods_near(pcm, hw, &periods, nullptr);
+        if(err >= 0) err = snd_pcm_hw_params(pcm, hw);
+        snd_pcm_uframes_t bufferFrames = 0;
+        if(err >= 0) {
+            snd_pcm_hw_params_get_period_size(hw, &periodFrames, nullptr);
+            snd_pcm_hw_params_get_buffer_size(hw, &bufferFrames);
+        }
+        snd_pcm_hw_params_free(hw);
+        if(err < 0) return fail("hardware parameters", err);
+        
+        // Wake up once a period is free; start explicitly once the buffer is primed
+        snd_pcm_sw_params_t* sw;
+        snd_pcm_sw_params_malloc(&sw);
+        snd_pcm_sw_params_current(pcm, sw);
+        snd_pcm_sw_params_set_avail_min(pcm, sw, periodFrames);
+        snd_pcm_sw_params_set_start_threshold(pcm, sw, bufferFrames * 2);
+        err = snd_pcm_sw_params(pcm, sw);
+        snd_pcm_sw_params_free(sw);
+        if(err < 0) return fail("software parameters", err);
+        
+        sampleRate = rate;
+        framesPerBuffer = periodFrames;
+        outputLatency = (double)bufferFrames / rate;
+        setOutput(sampleFormat, config);
+        std::cout << "ALSA " << device << ": " << snd_pcm_format_name(pcmFormat) << ", " << rate << " Hz, "
+                  << periodFrames << " frames x " << bufferFrames / std::max<snd_pcm_uframes_t>(1, periodFrames)
+                  << " periods" << std::endl;
+        return true;
+    }
+    
+    bool start() override {
+        running = true;
+        thread = std::thread(&AlsaBackend::loop, this);
+        return true;
+    }
+    
+    void stop() override {
+        if(!running.exchange(false)) return;
+        thread.join();
+        snd_pcm_drop(pcm);
+    }
+    
+    void close() override {
+        stop();
+        if(pcm) snd_pcm_close(pcm);
+        pcm = nullptr;
+    }
+    
+    double time() const override { return steadySeconds(); }
+    
+private:
+    bool fail(const char* what, int err) {
+        error = std::string("ALSA ") + what + ": " + snd_strerror(err);
+        return false;
+    }
+    
+    void loop() {
+        bool primed = false;
+        bool underflow = false;
+        while(running.load(std::memory_order_relaxed)) {
+            if(snd_pcm_state(pcm) == SND_PCM_STATE_XRUN) {
+                snd_pcm_recover(pcm, -EPIPE, 1);
+                underflow = true;
+                primed = false;
+            }
+            snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm);
+            if(avail < 0) {
+                snd_pcm_recover(pcm, (int)avail, 1);
+                underflow = true;
+                primed = false;
+                continue;
+            }
+            if((snd_pcm_uframes_t)avail < periodFrames) {
+                if(!primed) {
+                    primed = true;
+                    snd_pcm_start(pcm);
+                } else {
+                    snd_pcm_wait(pcm, 100);
+                }
+                continue;
+            }
+            
+            AudioCallbackInfo info = {steadySeconds(), 0.0, underflow, false};
+            snd_pcm_sframes_t delay = 0;
+            if(primed && snd_pcm_delay(pcm, &delay) == 0) {
+                info.outputTime = info.currentTime + (double)delay / rate;
+            }
+            underflow = false;
+            
+            snd_pcm_uframes_t remaining = periodFrames;
+            while(remaining > 0) {
+                const snd_pcm_channel_area_t* areas;
+                snd_pcm_uframes_t offset, frames = remaining;
+                int err = snd_pcm_mmap_begin(pcm, &areas, &offset, &frames);
+                if(err < 0) {
+                    snd_pcm_recover(pcm, err, 1);
+                    underflow = true;
+                    primed = false;
+                    break;
+                }
+                writeFrames(areas, offset, frames, info);
+                snd_pcm_sframes_t committed = snd_pcm_mmap_commit(pcm, offset, frames);
+                if(committed < 0 || (snd_pcm_uframes_t)committed != frames) {
+                    snd_pcm_recover(pcm, committed >= 0 ? -EPIPE : (int)committed, 1);
+                    underflow = true;
+                    primed = false;
+                    break;
+                }
+                if(info.outputTime > 0.0) info.outputTime += (double)frames / rate;
+                remaining -= frames;
+            }
+        }
+    }
+    
+    // Interleaved areas: channel 0's area starts at the frame, step is the frame size.
+    // Non-interleaved: one area per channel, each its own contiguous run.
+    void writeFrames(const snd_pcm_channel_area_t* areas, snd_pcm_uframes_t offset,
+                     snd_pcm_uframes_t frames, const AudioCallbackInfo& info) {
+        if(!nonInterleaved) {
+            char* base = (char*)areas[0].addr + (areas[0].first + offset * areas[0].step) / 8;
+            stage.pull(render, user, info, rate, base, frames);
+            return;
+        }
+        void* runs[MAX_OUTPUT_CHANNELS];
+        for(int c = 0; c < channels; c++) {
+            runs[c] = (char*)areas[c].addr + (areas[c].first + offset * areas[c].step) / 8;
+        }
+        stage.pull(render, user, info, rate, runs, frames);
+    }
+};
+#endif
+
+// No device at all: the render function is called on a precise timer, one
+// buffer per period, and the output is optionally written to a WAV file.
+// Late wakeups are reported as underflows, like a real device would.
+struct NullBackend : AudioBackend {
+    AudioBackendConfig config;
+    AudioRenderFn render;
+    void* user;
+    DiskWriter disk;
+    WavWriter wav;
+    std::vector<float> buffer;
+    std::vector<uint8_t> deviceBuffer; // Converted output, when the format isn't interleaved float
+    void* deviceRuns[MAX_OUTPUT_CHANNELS];
+    std::thread thread;
+    std::atomic<bool> running;
+    
+    NullBackend() : render(nullptr), user(nullptr), deviceRuns(), running(false) {}
+    ~NullBackend() {
+        close();
+        if(disk.fd >= 0) {
+            uint8_t header[WAV_HEADER_BYTES];
+            wav.header(header);
+            if(!disk.finish(header, sizeof(header))) std::cerr << disk.error << std::endl;
+        }
+    }
+    
+    const char* name() const override { return "null"; }
+    
+    bool open(const AudioBackendConfig& backendConfig, AudioRenderFn renderFn, void* userData) override {
+        config = backendConfig;
+        if(!config.framesPerBuffer) config.framesPerBuffer = DEFAULT_FRAMES_PER_BUFFER;
+        render = renderFn;
+        user = userData;
+        sampleRate = config.sampleRate;
+        framesPerBuffer = config.framesPerBuffer;
+        outputLatency = config.framesPerBuffer / config.sampleRate;
+        buffer.assign(config.framesPerBuffer * config.channels, 0.0f);
+        // No device, but the conversion still runs so it can be profiled
+        setOutput(config.format == FORMAT_AUTO ? FORMAT_FLOAT32 : config.format, config);
+        deviceBuffer.assign(config.framesPerBuffer * config.channels * sampleFormatBytes[format], 0);
+        for(int c = 0; c < config.channels && c < MAX_OUTPUT_CHANNELS; c++) {
+            deviceRuns[c] = &deviceBuffer[config.framesPerBuffer * c * sampleFormatBytes[format]];
+        }
+        if(!config.outputPath.empty() && disk.fd < 0 &&
+           !(disk.open(config.outputPath, false) && wav.start((uint32_t)config.sampleRate, config.channels, disk))) {
+            error = disk.error;
+            return false;
+        }
+        return true;
+    }
+    
+    bool start() override {
+        running = true;
+        thread = std::thread(&NullBackend::loop, this);
+        return true;
+    }
+    
+    void stop() override {
+        if(running.exchange(false)) thread.join();
+    }
+    
+    // The WAV file stays open until the backend is destroyed, across reopens
+    void close() override {
+        stop();
+    }
+    
+    double time() const override { return steadySeconds(); }
+    
+private:
+    void loop() {
+        const auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(config.framesPerBuffer / config.sampleRate));
+        auto deadline = std::chrono::steady_clock::now();
+        bool underflow = false;
+        while(running.load(std::memory_order_relaxed)) {
+            // Each buffer is "played" one period after it was due
+            AudioCallbackInfo info = {steadySeconds(), 0.0, underflow, false};
+            info.outputTime = std::chrono::duration<double>((deadline + period).time_since_epoch()).count();
+            render(buffer.data(), config.framesPerBuffer, info, user);
+            if(!stage.direct()) {
+                stage.write(buffer.data(), nonInterleaved ? (void*)deviceRuns : (void*)deviceBuffer.data(), 0,
+                            config.framesPerBuffer);
+            }
+            if(disk.fd >= 0) wav.write(buffer.data(), config.framesPerBuffer, disk);
+            
+            deadline += period;
+            underflow = std::chrono::steady_clock::now() > deadline;
+            if(underflow) {
+                deadline = std::chrono::steady_clock::now(); // Resync rather than burst to catch up
+            } else {
+                std::this_thread::sleep_until(deadline);
+            }
+        }
+    }
+};
+
+static AudioBackend* createAudioBackend(const std::string& name) {
+    if(name == "portaudio") return new PortAudioBackend();
+#ifdef WAVE_HAVE_ALSA
+    if(name == "alsa") return new AlsaBackend();
+#endif
+    if(name == "null") return new NullBackend();
+    return nullptr;
+}
+
+// Opens and starts a backend, moving the engine to the rate the device runs
+// at. With render-ahead depth > 0 the callback is fed by a DSP thread.
+static bool startAudio(AudioBackend& audio, const AudioBackendConfig& config, SawtoothData& data,
+                       RenderAhead& ahead, int renderAheadDepth) {
+    bool opened = renderAheadDepth > 0 ? audio.open(config, renderAheadCallback, &ahead)
+                                       : audio.open(config, sawtoothCallback, &data);
+    if(!opened) return false;
+    data.setSampleRate(audio.sampleRate);
+    data.realtimeThreadReady = false; // The backend may run us on a new thread
+    // Variable-size callbacks are fed in oscillator-sized blocks
+    unsigned long blockFrames = audio.framesPerBuffer ? audio.framesPerBuffer : OSC_BLOCK_FRAMES;
+    if(renderAheadDepth > 0) {
+        ahead.start(&data, blockFrames, renderAheadDepth, audio.framesPerBuffer);
+    }
+    // An event can arrive just after a buffer was rendered, so it waits for the
+    // next one, plus whatever is queued ahead of it, plus the device latency
+    data.eventDelay = audio.outputLatency + (double)blockFrames * (1 + renderAheadDepth) / audio.sampleRate;
+    if(audio.start()) return true;
+    ahead.stop();
+    return false;
+}
+
+static void stopAudio(AudioBackend& audio, RenderAhead& ahead) {
+    audio.stop();
+    audio.close();
+    ahead.stop();
+}
+
+static void printAudioSettings(const AudioBackend& audio) {
+    std::cout << "Audio backend: " << audio.name() << ", " << sampleFormatNames[audio.format]
+              << (audio.nonInterleaved ? " non-interleaved, " : ", ") << audio.sampleRate << " Hz, ";
+    if(audio.framesPerBuffer) {
+        std::cout << audio.framesPerBuffer << " frames per buffer";
+    } else {
+        std::cout << "variable buffer size";
+    }
+    std::cout << ", output latency " << audio.outputLatency * 1000.0 << " ms" << std::endl;
+}
+
+// Adaptive buffer sizing (--adaptive): start from the smallest buffer the
+// device accepts, double it when underflows pile up and try half the size
+// again after a stretch without any. Every time a size has to be abandoned
+// it must stay clean twice as long before it is tried again, so a host that
+// only just fails at some size doesn't flap between the two.
+#define ADAPTIVE_MIN_FRAMES 32
+#define ADAPTIVE_MAX_FRAMES 4096
+#define ADAPTIVE_LEVELS 8              // Powers of two from ADAPTIVE_MIN_FRAMES to ADAPTIVE_MAX_FRAMES
+#define ADAPTIVE_UNDERFLOW_LIMIT 3     // Underflows within one window that make the buffer grow
+#define ADAPTIVE_WINDOW_SECONDS 5.0
+#define ADAPTIVE_STABLE_SECONDS 30.0   // Underflow-free time before the buffer shrinks
+#define ADAPTIVE_MAX_STABLE_SECONDS 600.0
+#define ADAPTIVE_SETTLE_SECONDS 0.5    // Underflows right after a (re)start are ignored
+
+struct AdaptiveBuffer {
+    unsigned long frames;                  // 0 until the first start
+    uint64_t lastUnderflows;
+    int windowUnderflows;
+    double windowStart;
+    double cleanSince;
+    double settleUntil;
+    double stableSeconds[ADAPTIVE_LEVELS]; // Clean time needed before shrinking to each size
+    
+    AdaptiveBuffer() : frames(0), lastUnderflows(0), windowUnderflows(0),
+                       windowStart(0.0), cleanSince(0.0), settleUntil(0.0) {
+        for(double& seconds : stableSeconds) seconds = ADAPTIVE_STABLE_SECONDS;
+    }
+    
+    static int level(unsigned long size) {
+        int n = 0;
+        while(n < ADAPTIVE_LEVELS - 1 && (unsigned long)ADAPTIVE_MIN_FRAMES << (n + 1) <= size) n++;
+        return n;
+    }
+    
+    // Main thread, after every (re)start; size is what the backend negotiated.
+    // Only a size that update() gave up on is penalised, not one the backend
+    // rounded up from before it was ever tried.
+    void started(unsigned long size, double now, uint64_t underflows) {
+        if(frames > 0 && size > frames) {
+            double& seconds = stableSeconds[level(frames)];
+            seconds = std::min(ADAPTIVE_MAX_STABLE_SECONDS, seconds * 2.0);
         }
-        drawText(renderer, x - 15, y + KNOB_RADIUS + 25, std::string(valueStr));
+        frames = size;
+        lastUnderflows = underflows;
+        windowUnderflows = 0;
+        settleUntil = now + ADAPTIVE_SETTLE_SECONDS;
+        windowStart = cleanSince = settleUntil;
     }
     
-private:
-    void drawCircle(SDL_Renderer* renderer, int centerX, int centerY, int radius, int r, int g, int b) {
-        SDL_SetRenderDrawColor(renderer, r, g, b, 255);
-        for (int w = 0; w < radius * 2; w++) {
-            for (int h = 0; h < radius * 2; h++) {
-                int dx = radius - w;
-                int dy = radius - h;
-                if ((dx*dx + dy*dy) <= (radius * radius)) {
-                    SDL_RenderDrawPoint(renderer, centerX + dx, centerY + dy);
-                }
-            }
+    // Main thread, polled; returns the buffer size to reopen with, or 0 to keep this one
+    unsigned long update(double now, uint64_t underflows) {
+        uint64_t fresh = underflows - lastUnderflows;
+        lastUnderflows = underflows;
+        if(now < settleUntil) return 0;
+        if(fresh > 0) {
+            windowUnderflows += (int)std::min<uint64_t>(fresh, ADAPTIVE_UNDERFLOW_LIMIT);
+            cleanSince = now;
+        }
+        if(now - windowStart > ADAPTIVE_WINDOW_SECONDS) {
+            windowStart = now;
+            windowUnderflows = 0;
+        }
+        if(windowUnderflows >= ADAPTIVE_UNDERFLOW_LIMIT && frames < ADAPTIVE_MAX_FRAMES) {
+            return std::min<unsigned long>(ADAPTIVE_MAX_FRAMES, frames * 2);
         }
+        if(frames > ADAPTIVE_MIN_FRAMES && now - cleanSince >= stableSeconds[level(frames / 2)]) {
+            return std::max<unsigned long>(ADAPTIVE_MIN_FRAMES, frames / 2);
+        }
+        return 0;
     }
+};
+
+// Scope trace geometry, allocated once. The thin trace is a single
+// SDL_RenderDrawLines polyline; the thick one (T key, SDL 2.0.18+) is one
+// SDL_RenderGeometry call over a strip four vertices wide per point, opaque
+// in the middle and fading to transparent over one pixel on either side.
+#define SCOPE_THICK_WIDTH 2.5f
+
+struct ScopeTrace {
+    std::vector<SDL_Point> points;
+    bool thick;
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+    std::vector<SDL_Vertex> vertices;
+    std::vector<int> indices;
+#endif
     
-    void drawCircleOutline(SDL_Renderer* renderer, int centerX, int centerY, int radius, int r, int g, int b) {
-        SDL_SetRenderDrawColor(renderer, r, g, b, 255);
-        int x = radius - 1;
-        int y = 0;
-        int dx = 1;
-        int dy = 1;
-        int err = dx - (radius << 1);
-        
-        while (x >= y) {
-            SDL_RenderDrawPoint(renderer, centerX + x, centerY + y);
-            SDL_RenderDrawPoint(renderer, centerX + y, centerY + x);
-            SDL_RenderDrawPoint(renderer, centerX - y, centerY + x);
-            SDL_RenderDrawPoint(renderer, centerX - x, centerY + y);
-            SDL_RenderDrawPoint(renderer, centerX - x, centerY - y);
-            SDL_RenderDrawPoint(renderer, centerX - y, centerY - x);
-            SDL_RenderDrawPoint(renderer, centerX + y, centerY - x);
-            SDL_RenderDrawPoint(renderer, centerX + x, centerY - y);
-            
-            if (err <= 0) {
-                y++;
-                err += dy;
-                dy += 2;
-            }
-            if (err > 0) {
-                x--;
-                dx += 2;
-                err += dx - (radius << 1);
+    ScopeTrace() : points(WAVE_SAMPLES), thick(false) {
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+        vertices.resize(WAVE_SAMPLES * 4);
+        // Three quads across each segment: fade in, core, fade out
+        for(int i = 0; i + 1 < WAVE_SAMPLES; i++) {
+            for(int strip = 0; strip < 3; strip++) {
+                int a = i * 4 + strip, b = a + 1, c = a + 4, d = b + 4;
+                int quad[6] = {a, b, c, b, d, c};
+                indices.insert(indices.end(), quad, quad + 6);
             }
         }
+#endif
     }
     
-    void drawText(SDL_Renderer* renderer, int x, int y, const std::string& text) {
-        // Simple bitmap-style text rendering
-        SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-        // This is a very basic implementation - you could use SDL_ttf for better text
-        // For now, just draw a simple representation
-        SDL_Rect rect = {x, y, (int)text.length() * 6, 10};
-        SDL_RenderDrawRect(renderer, &rect);
-    }
+    static bool thickAvailable() { return SDL_VERSION_ATLEAST(2, 0, 18); }
 };
 
-struct SawtoothData {
-    float frequency;
-    float phase;
-    float phaseOffset;
-    float amplitude;
-    std::vector<float> waveBuffer;
-    int bufferIndex;
-    std::mutex bufferMutex;
-    
-    SawtoothData() : frequency(440.0f), phase(0.0f), phaseOffset(0.0f), amplitude(0.3f), 
-                     waveBuffer(WAVE_SAMPLES, 0.0f), bufferIndex(0) {}
-};
+// Hand tracking cursor: soft-edged discs for the open and the pinched hand,
+// built like the knob sprites and drawn with one copy each frame. With
+// --hand-trail N the last N positions the hand moved through are drawn
+// behind it, fading with age through the texture's alpha modulation.
+#define HAND_CURSOR_RADIUS 25
+#define HAND_CURSOR_SOFTNESS 3.0f // Width of the fading edge, in window coordinates
+#define MAX_HAND_TRAIL 64
 
-// Audio callback
-static int sawtoothCallback(const void* inputBuffer, void* outputBuffer,
-                           unsigned long framesPerBuffer,
-                           const PaStreamCallbackTimeInfo* timeInfo,
-                           PaStreamCallbackFlags statusFlags,
-                           void* userData) {
+struct HandCursor {
+    struct Position {
+        int x, y;
+        bool pinch;
+    };
     
-    SawtoothData* data = (SawtoothData*)userData;
-    float* out = (float*)outputBuffer;
+    SDL_Texture* textures[2];   // Open, pinched
+    float scale;
+    Position trail[MAX_HAND_TRAIL];
+    int trailLength;            // Positions kept, 0 for no trail
+    int trailCount;
+    int trailHead;              // Where the next position goes
     
-    std::lock_guard<std::mutex> lock(data->bufferMutex);
+    HandCursor() : textures(), scale(0.0f), trail(), trailLength(0), trailCount(0), trailHead(0) {}
+    ~HandCursor() { release(); }
     
-    for(unsigned long i = 0; i < framesPerBuffer; i++) {
-        // Apply phase offset
-        float adjustedPhase = fmod(data->phase + data->phaseOffset, 1.0f);
-        if (adjustedPhase < 0) adjustedPhase += 1.0f;
-        
-        // Generate sawtooth wave
-        float sample = (2.0f * adjustedPhase - 1.0f) * data->amplitude;
-        
-        if(i % 4 == 0) {
-            data->waveBuffer[data->bufferIndex] = sample;
-            data->bufferIndex = (data->bufferIndex + 1) % WAVE_SAMPLES;
+    void release() {
+        for(SDL_Texture*& texture : textures) {
+            if(texture) SDL_DestroyTexture(texture);
+            texture = nullptr;
         }
-        
-        *out++ = sample;
-        *out++ = sample;
-        
-        // Update phase
-        data->phase += data->frequency / SAMPLE_RATE;
-        if(data->phase >= 1.0f) {
-            data->phase -= 1.0f;
+    }
+    
+    bool prepare(SDL_Renderer* renderer, float pixelScale) {
+        if(textures[0] && textures[1] && pixelScale == scale) return true;
+        release();
+        scale = pixelScale;
+        static const Uint8 colors[2][3] = {{0, 200, 255}, {255, 80, 180}}; // Cyan, pink
+        for(int pinch = 0; pinch < 2; pinch++) {
+            textures[pinch] = rasterizeSprite(renderer, scale, HAND_CURSOR_RADIUS + 1,
+                                              [&](float x, float y, float& r, float& g, float& b) {
+                r = colors[pinch][0];
+                g = colors[pinch][1];
+                b = colors[pinch][2];
+                return edgeCoverage(HAND_CURSOR_RADIUS - HAND_CURSOR_SOFTNESS * 0.5f - sqrtf(x * x + y * y),
+                                    HAND_CURSOR_SOFTNESS);
+            });
         }
+        return textures[0] && textures[1];
     }
     
-    return paContinue;
-}
+    void draw(SDL_Renderer* renderer, int x, int y, bool pinch) {
+        if(trailLength > 0) {
+            int newest = (trailHead + MAX_HAND_TRAIL - 1) % MAX_HAND_TRAIL;
+            if(trailCount == 0 || trail[newest].x != x || trail[newest].y != y) {
+                trail[trailHead] = {x, y, pinch};
+                trailHead = (trailHead + 1) % MAX_HAND_TRAIL;
+                trailCount = std::min(trailCount + 1, trailLength);
+            }
+            // Oldest first, so newer positions land on top; the newest is the cursor itself
+            for(int age = trailCount - 1; age >= 1; age--) {
+                const Position& position = trail[(trailHead + MAX_HAND_TRAIL - 1 - age) % MAX_HAND_TRAIL];
+                drawAt(renderer, position.x, position.y, position.pinch, 1.0f - (float)age / trailCount);
+            }
+        }
+        drawAt(renderer, x, y, pinch, 1.0f);
+    }
+    
+private:
+    void drawAt(SDL_Renderer* renderer, int x, int y, bool pinch, float fade) {
+        SDL_Texture* texture = textures[pinch];
+        SDL_SetTextureAlphaMod(texture, (Uint8)lrintf((pinch ? 120 : 100) * fade));
+        SDL_Rect rect = {x - (HAND_CURSOR_RADIUS + 1), y - (HAND_CURSOR_RADIUS + 1),
+                         2 * (HAND_CURSOR_RADIUS + 1), 2 * (HAND_CURSOR_RADIUS + 1)};
+        SDL_RenderCopy(renderer, texture, nullptr, &rect);
+    }
+};
 
-void drawWaveform(SDL_Renderer* renderer, SawtoothData& data) {
-    std::lock_guard<std::mutex> lock(data.bufferMutex);
+void drawWaveform(SDL_Renderer* renderer, SawtoothData& data, ScopeTrace& trace, float renderScale) {
+    const float* wave = data.scope.latest();
     
     SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255); // Red color
     
     int waveAreaHeight = WINDOW_HEIGHT - KNOB_PANEL_HEIGHT;
-    int centerY = waveAreaHeight / 2;
-    int scaleY = waveAreaHeight * 0.4f;
+    float centerY = waveAreaHeight / 2;
+    float scaleY = waveAreaHeight * 0.4f;
+    const float stepX = (float)WINDOW_WIDTH / WAVE_SAMPLES;
     
-    for(int i = 0; i < WAVE_SAMPLES - 1; i++) {
-        int sampleIndex1 = (data.bufferIndex + i) % WAVE_SAMPLES;
-        int sampleIndex2 = (data.bufferIndex + i + 1) % WAVE_SAMPLES;
-        
-        float sample1 = data.waveBuffer[sampleIndex1];
-        float sample2 = data.waveBuffer[sampleIndex2];
-        
-        int x1 = i * WINDOW_WIDTH / WAVE_SAMPLES;
-        int y1 = centerY - (sample1 * scaleY);
-        int x2 = (i + 1) * WINDOW_WIDTH / WAVE_SAMPLES;
-        int y2 = centerY - (sample2 * scaleY);
-        
-        SDL_RenderDrawLine(renderer, x1, y1, x2, y2);
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+    if(trace.thick) {
+        const float core = 0.5f * SCOPE_THICK_WIDTH, fade = 1.0f / renderScale;
+        const float offsets[4] = {-core - fade, -core, core, core + fade};
+        const Uint8 alphas[4] = {0, 255, 255, 0};
+        for(int i = 0; i < WAVE_SAMPLES; i++) {
+            // Normal to the chord through the neighbouring points
+            int previous = std::max(i - 1, 0), next = std::min(i + 1, WAVE_SAMPLES - 1);
+            float dx = (next - previous) * stepX, dy = (wave[previous] - wave[next]) * scaleY;
+            float length = sqrtf(dx * dx + dy * dy);
+            float nx = -dy / length, ny = dx / length;
+            float x = i * stepX, y = centerY - wave[i] * scaleY;
+            for(int k = 0; k < 4; k++) {
+                SDL_Vertex& vertex = trace.vertices[i * 4 + k];
+                vertex.position = {x + nx * offsets[k], y + ny * offsets[k]};
+                vertex.color = {255, 0, 0, alphas[k]};
+                vertex.tex_coord = {0.0f, 0.0f};
+            }
+        }
+        SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+        SDL_RenderGeometry(renderer, nullptr, trace.vertices.data(), (int)trace.vertices.size(),
+                           trace.indices.data(), (int)trace.indices.size());
+        SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+        return;
+    }
+#else
+    (void)renderScale; // Only the thick trace feathers its edges by a device pixel
+#endif
+    
+    for(int i = 0; i < WAVE_SAMPLES; i++) {
+        trace.points[i] = {(int)(i * stepX), (int)(centerY - wave[i] * scaleY)};
     }
+    SDL_RenderDrawLines(renderer, trace.points.data(), WAVE_SAMPLES);
 }
 
 void drawGrid(SDL_Renderer* renderer) {
@@ -240,21 +3592,726 @@ void drawGrid(SDL_Renderer* renderer) {
     SDL_RenderDrawLine(renderer, 0, waveAreaHeight, WINDOW_WIDTH, waveAreaHeight);
 }
 
+// Output pixels per window coordinate: 2 on a Retina display, 1 elsewhere.
+// The renderer is scaled to match, so all drawing stays in window coordinates.
+static float updateRenderScale(SDL_Window* window, SDL_Renderer* renderer) {
+    int windowWidth = 0, windowHeight = 0, outputWidth = 0, outputHeight = 0;
+    SDL_GetWindowSize(window, &windowWidth, &windowHeight);
+    SDL_GetRendererOutputSize(renderer, &outputWidth, &outputHeight);
+    float scale = windowWidth > 0 && outputWidth > 0 ? (float)outputWidth / windowWidth : 1.0f;
+    SDL_RenderSetScale(renderer, scale, scale);
+    return scale;
+}
+
 void drawTitle(SDL_Renderer* renderer) {
-    // Simple title - you could use SDL_ttf for better text
+    // Title frame; the text inside goes out with the rest of the text batch
     SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
     SDL_Rect titleRect = {10, 10, 200, 20};
     SDL_RenderDrawRect(renderer, &titleRect);
+}
+
+// Everything behind the scope and knobs that doesn't change from frame to frame
+static void drawBackground(SDL_Renderer* renderer) {
+    // Clear screen (black background)
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+    SDL_RenderClear(renderer);
+    
+    drawTitle(renderer);
+    drawGrid(renderer);
+    
+    // Draw control panel background
+    SDL_SetRenderDrawColor(renderer, 30, 30, 30, 255);
+    SDL_Rect controlPanel = {0, WINDOW_HEIGHT - KNOB_PANEL_HEIGHT, WINDOW_WIDTH, KNOB_PANEL_HEIGHT};
+    SDL_RenderFillRect(renderer, &controlPanel);
+}
+
+// The background drawn once into a target texture at the output's pixel
+// size and composited with a single copy. Redrawn when the output size
+// changes or the renderer drops its targets (SDL_RENDER_TARGETS_RESET);
+// drawn directly every frame if the renderer has no target textures.
+struct BackgroundLayer {
+    SDL_Texture* texture;
+    int width, height;  // Output pixels
+    bool valid;
+    
+    BackgroundLayer() : texture(nullptr), width(0), height(0), valid(false) {}
+    ~BackgroundLayer() { release(); }
+    
+    void invalidate() { valid = false; }
+    
+    void release() {
+        if(texture) SDL_DestroyTexture(texture);
+        texture = nullptr;
+        valid = false;
+    }
+    
+    void draw(SDL_Renderer* renderer, float renderScale) {
+        int outputWidth = 0, outputHeight = 0;
+        SDL_GetRendererOutputSize(renderer, &outputWidth, &outputHeight);
+        if(!texture || outputWidth != width || outputHeight != height) {
+            release();
+            width = outputWidth;
+            height = outputHeight;
+            if(SDL_RenderTargetSupported(renderer)) {
+                texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, width, height);
+            }
+        }
+        if(!texture) {
+            drawBackground(renderer);
+            return;
+        }
+        if(!valid) {
+            // Targets start at scale 1; the window's scale comes back with it
+            SDL_SetRenderTarget(renderer, texture);
+            SDL_RenderSetScale(renderer, renderScale, renderScale);
+            drawBackground(renderer);
+            SDL_SetRenderTarget(renderer, nullptr);
+            valid = true;
+        }
+        SDL_RenderCopy(renderer, texture, nullptr, nullptr);
+    }
+};
+
+static int lookupName(const char* const names[], int count, const std::string& name) {
+    for(int i = 0; i < count; i++) {
+        if(name == names[i]) return i;
+    }
+    return -1;
+}
+
+// Command line options
+struct Smoothing {
+    float seconds;
+    bool exponential;
+};
+
+struct Options {
+    bool bench;
+    int workers;          // Voice rendering threads besides the audio callback
+    int spinMicroseconds; // How long an idle worker spins before sleeping
+    std::string renderPath;   // Offline render to this WAV file instead of opening a window
+    double renderSeconds;
+    std::string timelinePath; // Parameter/note script for the offline render
+    std::string backend;      // portaudio, alsa or null
+    std::string device;       // Output device (PortAudio) or PCM name (ALSA)
+    int periods;              // ALSA periods per buffer
+    std::string nullOutput;   // WAV file for the null backend
+    double sampleRate;
+    unsigned long framesPerBuffer; // 0: whatever the backend prefers
+    double latency;           // Suggested output latency in seconds, or LATENCY_DEVICE_LOW/HIGH
+    bool adaptive;            // Size the buffer from observed underflows
+    bool realtime;            // SCHED_FIFO, locked memory and FTZ/DAZ for the audio threads
+    int renderAhead;          // Blocks queued by a DSP thread ahead of the callback; 0 renders in the callback
+    int format;               // SampleFormat for the device, or FORMAT_AUTO
+    bool nonInterleaved;
+    bool dither;              // TPDF dither when converting to 16 or 24 bits
+    std::string recordPath;   // Record the session to this WAV file
+    bool recordDirect;        // Write the recording with O_DIRECT
+    int recordThreads;        // FLAC encoding threads besides the writer thread
+    int handTrail;            // Past hand positions drawn behind the cursor
+    Smoothing frequencySmoothing;
+    Smoothing phaseSmoothing;
+    Smoothing amplitudeSmoothing;
+    
+    Options() : bench(false),
+                workers((int)std::min(3u, std::max(1u, std::thread::hardware_concurrency()) - 1)),
+                spinMicroseconds(200), renderSeconds(10.0), backend("portaudio"), periods(2),
+                sampleRate(DEFAULT_SAMPLE_RATE), framesPerBuffer(DEFAULT_FRAMES_PER_BUFFER),
+                latency(LATENCY_DEVICE_LOW), adaptive(false),
+                realtime(true), renderAhead(0), format(FORMAT_AUTO), nonInterleaved(false), dither(true),
+                recordDirect(false), recordThreads(2), handTrail(0),
+                frequencySmoothing({DEFAULT_FREQUENCY_SMOOTHING, true}),
+                phaseSmoothing({DEFAULT_PHASE_SMOOTHING, false}),
+                amplitudeSmoothing({DEFAULT_AMPLITUDE_SMOOTHING, false}) {}
+    
+    void applySmoothing(SawtoothData& data) const {
+        data.frequencyRamp.seconds = frequencySmoothing.seconds;
+        data.frequencyRamp.exponential = frequencySmoothing.exponential;
+        data.phaseRamp.seconds = phaseSmoothing.seconds;
+        data.phaseRamp.exponential = phaseSmoothing.exponential;
+        data.amplitudeRamp.seconds = amplitudeSmoothing.seconds;
+        data.amplitudeRamp.exponential = amplitudeSmoothing.exponential;
+    }
+};
+
+static void printUsage(const char* program) {
+    std::cerr << "Usage: " << program << " [options]" << std::endl;
+    std::cerr << "  --config FILE      Read options from a file, one \"name value\" per line" << std::endl;
+    std::cerr << "  --bench            Benchmark the oscillator modes and exit" << std::endl;
+    std::cerr << "  --workers N        Voice rendering threads besides the audio thread (0-"
+              << MAX_RENDER_WORKERS << "), used once they all get SCHED_FIFO" << std::endl;
+    std::cerr << "  --spin-us N        Microseconds an idle worker spins before sleeping" << std::endl;
+    std::cerr << "  --smooth P:MS[:S]  Smoothing time for frequency, phase or amplitude changes, with" << std::endl;
+    std::cerr << "                     S linear or exponential (defaults: frequency:20:exponential," << std::endl;
+    std::cerr << "                     phase:20:linear, amplitude:10:linear; 0 ms switches it off)" << std::endl;
+    std::cerr << "  --render-ahead N   Render N buffers ahead on a DSP thread; the callback only copies" << std::endl;
+    std::cerr << "                     (0, the default, renders in the callback)" << std::endl;
+    std::cerr << "  --hand-trail N     Draw the last N hand positions behind the cursor, fading (0-"
+              << MAX_HAND_TRAIL << ")" << std::endl;
+    std::cerr << "  --no-realtime      Don't request SCHED_FIFO, lock memory or flush denormals" << std::endl;
+    std::cerr << "  --backend NAME     Audio output: portaudio (default), "
+#ifdef WAVE_HAVE_ALSA
+              << "alsa, "
+#endif
+              << "null" << std::endl;
+    std::cerr << "  --rate HZ          Sample rate (default " << DEFAULT_SAMPLE_RATE << ")" << std::endl;
+    std::cerr << "  --frames N         Frames per buffer, 0 to let the device decide (default "
+              << DEFAULT_FRAMES_PER_BUFFER << ")" << std::endl;
+    std::cerr << "  --latency L        Suggested output latency: low, high or seconds (default low)" << std::endl;
+    std::cerr << "  --format F         Device sample format: auto (default), f32, s16, s24 or s32" << std::endl;
+    std::cerr << "  --non-interleaved  Hand the device one buffer per channel" << std::endl;
+    std::cerr << "  --no-dither        Don't dither when converting to 16 or 24 bits" << std::endl;
+    std::cerr << "  --adaptive         Start with the smallest buffer the device accepts, grow it on" << std::endl;
+    std::cerr << "                     repeated underflows and shrink it again once playback is stable" << std::endl;
+    std::cerr << "  --device NAME      Output device name, or ALSA PCM device (default \"default\")" << std::endl;
+    std::cerr << "  --periods N        ALSA periods in the device buffer (default 2)" << std::endl;
+    std::cerr << "  --null-output FILE Null backend: write the output to a WAV file" << std::endl;
+    std::cerr << "  --record FILE      Record everything played, from a writer thread: FILE.flac is" << std::endl;
+    std::cerr << "                     encoded as 24-bit FLAC, anything else is float WAV (RF64 past 4 GB)" << std::endl;
+    std::cerr << "  --record-threads N FLAC encoding threads besides the writer thread (0-"
+              << MAX_ENCODER_THREADS << ", default 2)" << std::endl;
+    std::cerr << "  --record-direct    Write the recording with O_DIRECT, bypassing the page cache" << std::endl;
+    std::cerr << "  --render FILE.wav  Render offline, without window or audio device, and exit" << std::endl;
+    std::cerr << "  --seconds S        Length of the offline render (default 10)" << std::endl;
+    std::cerr << "  --timeline FILE    Script for the offline render, one event per line:" << std::endl;
+    std::cerr << "                     <seconds> frequency|phase|amplitude <value>" << std::endl;
+    std::cerr << "                     <seconds> waveform saw|square|triangle" << std::endl;
+    std::cerr << "                     <seconds> mode naive|wavetable|polyblep" << std::endl;
+    std::cerr << "                     <seconds> note_on <midi note> [amplitude] | note_off <midi note>" << std::endl;
+}
+
+static bool parseOptions(const std::vector<std::string>& args, Options& options, int depth = 0);
+
+// Config file: the same options without the dashes, e.g. "rate 48000".
+// Blank lines and lines starting with # are skipped.
+static bool loadConfig(const std::string& path, Options& options, int depth) {
+    if(depth > 4) {
+        std::cerr << "Config files nested too deeply: " << path << std::endl;
+        return false;
+    }
+    FILE* file = fopen(path.c_str(), "r");
+    if(!file) {
+        std::cerr << "Can't open config " << path << std::endl;
+        return false;
+    }
+    std::vector<std::string> args;
+    char line[512];
+    while(fgets(line, sizeof(line), file)) {
+        char name[64];
+        int length = 0;
+        if(sscanf(line, " %63s %n", name, &length) < 1 || name[0] == '#') continue;
+        args.push_back(std::string("--") + name);
+        // The value is the rest of the line, so device names may contain spaces
+        std::string value = line + length;
+        value.erase(value.find_last_not_of(" \t\r\n") + 1);
+        if(!value.empty()) args.push_back(value);
+    }
+    fclose(file);
+    return parseOptions(args, options, depth + 1);
+}
+
+// PARAM:MS[:linear|exponential], PARAM one of frequency, phase, amplitude
+static bool parseSmoothing(const std::string& text, Options& options) {
+    char param[32], shape[32] = "";
+    float milliseconds;
+    if(sscanf(text.c_str(), "%31[^:]:%f:%31s", param, &milliseconds, shape) < 2 || milliseconds < 0.0f) return false;
+    Smoothing* smoothing = nullptr;
+    if(!strcmp(param, "frequency")) smoothing = &options.frequencySmoothing;
+    else if(!strcmp(param, "phase")) smoothing = &options.phaseSmoothing;
+    else if(!strcmp(param, "amplitude")) smoothing = &options.amplitudeSmoothing;
+    else return false;
+    smoothing->seconds = milliseconds / 1000.0f;
+    if(!strcmp(shape, "exponential") || !strcmp(shape, "exp")) smoothing->exponential = true;
+    else if(!strcmp(shape, "linear")) smoothing->exponential = false;
+    else if(shape[0]) return false;
+    return true;
+}
+
+static bool parseLatency(const std::string& text, double& latency) {
+    if(text == "low") {
+        latency = LATENCY_DEVICE_LOW;
+    } else if(text == "high") {
+        latency = LATENCY_DEVICE_HIGH;
+    } else {
+        char* end;
+        latency = strtod(text.c_str(), &end);
+        if(*end || latency < 0.0) return false;
+    }
+    return true;
+}
+
+static bool parseOptions(const std::vector<std::string>& args, Options& options, int depth) {
+    const int argc = (int)args.size();
+    std::vector<const char*> argv;
+    for(const std::string& arg : args) argv.push_back(arg.c_str());
+    for(int i = 0; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if(arg == "--config" && hasValue) {
+            if(!loadConfig(argv[++i], options, depth)) return false;
+        } else if(arg == "--rate" && hasValue) {
+            options.sampleRate = atof(argv[++i]);
+            if(options.sampleRate < 8000.0 || options.sampleRate > 384000.0) {
+                std::cerr << "Sample rate out of range: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if(arg == "--frames" && hasValue) {
+            options.framesPerBuffer = (unsigned long)std::max(0, std::min(8192, atoi(argv[++i])));
+        } else if(arg == "--latency" && hasValue) {
+            if(!parseLatency(argv[++i], options.latency)) {
+                std::cerr << "Bad latency: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if(arg == "--smooth" && hasValue) {
+            if(!parseSmoothing(argv[++i], options)) {
+                std::cerr << "Bad smoothing: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if(arg == "--format" && hasValue) {
+            std::string name = argv[++i];
+            options.format = name == "auto" ? FORMAT_AUTO : lookupName(sampleFormatNames, FORMAT_COUNT, name);
+            if(options.format == -1 && name != "auto") {
+                std::cerr << "Unknown sample format: " << name << std::endl;
+                return false;
+            }
+        } else if(arg == "--non-interleaved") {
+            options.nonInterleaved = true;
+        } else if(arg == "--no-dither") {
+            options.dither = false;
+        } else if(arg == "--adaptive") {
+            options.adaptive = true;
+        } else if(arg == "--render-ahead" && hasValue) {
+            options.renderAhead = std::max(0, std::min(MAX_RENDER_AHEAD, atoi(argv[++i])));
+        } else if(arg == "--hand-trail" && hasValue) {
+            options.handTrail = std::max(0, std::min(MAX_HAND_TRAIL, atoi(argv[++i])));
+        } else if(arg == "--no-realtime") {
+            options.realtime = false;
+        } else if(arg == "--bench") {
+            options.bench = true;
+        } else if(arg == "--workers" && hasValue) {
+            options.workers = std::max(0, std::min(MAX_RENDER_WORKERS, atoi(argv[++i])));
+        } else if(arg == "--spin-us" && hasValue) {
+            options.spinMicroseconds = std::max(0, atoi(argv[++i]));
+        } else if(arg == "--backend" && hasValue) {
+            options.backend = argv[++i];
+        } else if(arg == "--device" && hasValue) {
+            options.device = argv[++i];
+        } else if(arg == "--periods" && hasValue) {
+            options.periods = std::max(2, atoi(argv[++i]));
+        } else if(arg == "--null-output" && hasValue) {
+            options.nullOutput = argv[++i];
+        } else if(arg == "--record" && hasValue) {
+            options.recordPath = argv[++i];
+        } else if(arg == "--record-threads" && hasValue) {
+            options.recordThreads = std::max(0, std::min(MAX_ENCODER_THREADS, atoi(argv[++i])));
+        } else if(arg == "--record-direct") {
+            options.recordDirect = true;
+        } else if(arg == "--render" && hasValue) {
+            options.renderPath = argv[++i];
+        } else if(arg == "--seconds" && hasValue) {
+            options.renderSeconds = std::max(0.0, atof(argv[++i]));
+        } else if(arg == "--timeline" && hasValue) {
+            options.timelinePath = argv[++i];
+        } else {
+            std::cerr << "Unknown or incomplete option: " << arg << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Oscillator benchmark (--bench): per-sample cost and aliasing for each mode,
+// plus naive oscillators oversampled 2x/4x as the brute-force reference.
+#define BENCH_FFT_SIZE 8192
+#define BENCH_BLOCKS 20000
+
+static inline uint64_t cycleCounter() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// In-place iterative radix-2 FFT
+static void fft(std::vector<std::complex<double>>& x) {
+    const size_t n = x.size();
+    for(size_t i = 1, j = 0; i < n; i++) {
+        size_t bit = n >> 1;
+        for(; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if(i < j) std::swap(x[i], x[j]);
+    }
+    for(size_t len = 2; len <= n; len <<= 1) {
+        std::complex<double> step = std::polar(1.0, -2.0 * M_PI / len);
+        for(size_t i = 0; i < n; i += len) {
+            std::complex<double> w(1.0);
+            for(size_t k = 0; k < len / 2; k++) {
+                std::complex<double> a = x[i + k], b = x[i + k + len / 2] * w;
+                x[i + k] = a + b;
+                x[i + k + len / 2] = a - b;
+                w *= step;
+            }
+        }
+    }
+}
+
+// Power on the harmonics of the test tone against everything else but DC, in dB.
+// The tone sits exactly on an FFT bin, so no window is needed and aliased
+// partials, which fold onto non-harmonic bins, are all counted as noise.
+static double aliasingSnr(const std::vector<float>& signal, int fundamentalBin) {
+    std::vector<std::complex<double>> spectrum(signal.begin(), signal.end());
+    fft(spectrum);
+    double harmonic = 0.0, noise = 0.0;
+    for(size_t bin = 1; bin <= spectrum.size() / 2; bin++) {
+        double power = std::norm(spectrum[bin]);
+        if(bin % fundamentalBin == 0) {
+            harmonic += power;
+        } else {
+            noise += power;
+        }
+    }
+    return 10.0 * log10(harmonic / std::max(noise, 1e-30));
+}
+
+// Naive oscillator rendered at factor times the sample rate and brought back
+// down with a Blackman-windowed sinc FIR that only evaluates kept samples.
+// The FIR is symmetric, so the taps can be applied in buffer order.
+struct OversampledOscillator {
+    int factor;
+    std::vector<float> taps;
+    std::vector<float> buffer; // taps - 1 samples of history, then the current block
+    
+    OversampledOscillator(int factor) : factor(factor), taps(64 * factor),
+                                        buffer(taps.size() - 1 + OSC_BLOCK_FRAMES * factor, 0.0f) {
+        const double cutoff = 0.45 / factor;
+        const int n = (int)taps.size();
+        double sum = 0.0;
+        for(int k = 0; k < n; k++) {
+            double x = k - (n - 1) / 2.0;
+            double sinc = x == 0.0 ? 2.0 * cutoff : sin(2.0 * M_PI * cutoff * x) / (M_PI * x);
+            double window = 0.42 - 0.5 * cos(2.0 * M_PI * k / (n - 1)) + 0.08 * cos(4.0 * M_PI * k / (n - 1));
+            taps[k] = (float)(sinc * window);
+            sum += taps[k];
+        }
+        for(float& tap : taps) tap = (float)(tap / sum);
+    }
+    
+    void render(float* out, unsigned long frames, uint32_t phase, uint32_t increment, float amplitude, int waveform) {
+        const size_t history = taps.size() - 1;
+        float* highRate = buffer.data() + history;
+        renderNaiveBlock(highRate, frames * factor, phase, increment / factor, amplitude, waveform);
+        for(unsigned long i = 0; i < frames; i++) {
+            const float* x = buffer.data() + i * factor;
+            float acc[4] = {0.0f, 0.0f, 0.0f, 0.0f}; // Independent sums so the adds can overlap
+            for(size_t k = 0; k < taps.size(); k += 4) {
+                acc[0] += taps[k] * x[k];
+                acc[1] += taps[k + 1] * x[k + 1];
+                acc[2] += taps[k + 2] * x[k + 2];
+                acc[3] += taps[k + 3] * x[k + 3];
+            }
+            out[i] = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+        }
+        std::memmove(buffer.data(), highRate + frames * factor - history, history * sizeof(float));
+    }
+};
+
+static int runOscillatorBenchmark(const Options& options) {
+    enum { BENCH_NAIVE, BENCH_POLYBLEP, BENCH_WAVETABLE, BENCH_OVERSAMPLE_2X, BENCH_OVERSAMPLE_4X, BENCH_MODES };
+    static const char* const modeNames[BENCH_MODES] = {"naive", "polyblep", "wavetable", "naive 2x", "naive 4x"};
+    static const int testBins[2] = {82, 371}; // ~441 Hz and ~1997 Hz at 44.1 kHz, scaled with the rate
+    
+    WavetableBank wavetables;
+    wavetables.build();
+    std::vector<float> block(OSC_BLOCK_FRAMES);
     
-    // Draw "Sawtooth Wave Generator" as simple text
-    for(int i = 0; i < 20; i++) {
-        SDL_RenderDrawPoint(renderer, 15 + i, 15);
-        SDL_RenderDrawPoint(renderer, 15 + i, 25);
+    const double sampleRate = options.sampleRate;
+    printf("Oscillator benchmark: %d-frame blocks at %.0f Hz\n", OSC_BLOCK_FRAMES, sampleRate);
+    char snrLabels[2][32];
+    for(int t = 0; t < 2; t++) {
+        snprintf(snrLabels[t], sizeof(snrLabels[t]), "SNR@%.0fHz", testBins[t] * sampleRate / BENCH_FFT_SIZE);
     }
+    printf("%-9s %-10s %10s %14s %12s %12s\n", "waveform", "mode", "ns/sample", "cycles/sample",
+           snrLabels[0], snrLabels[1]);
+    
+    for(int waveform = 0; waveform < WAVE_COUNT; waveform++) {
+        for(int mode = 0; mode < BENCH_MODES; mode++) {
+            OversampledOscillator oversampler(mode == BENCH_OVERSAMPLE_4X ? 4 : 2);
+            auto render = [&](uint32_t phase, uint32_t increment) {
+                switch(mode) {
+                    case BENCH_POLYBLEP:
+                        renderPolyBlepBlock(block.data(), block.size(), phase, increment, 0.5f, waveform);
+                        break;
+                    case BENCH_WAVETABLE:
+                        renderWavetableBlock(block.data(), block.size(),
+                                             wavetables.table(waveform, WavetableBank::levelFor(increment)),
+                                             phase, increment, 0.5f);
+                        break;
+                    case BENCH_OVERSAMPLE_2X:
+                    case BENCH_OVERSAMPLE_4X:
+                        oversampler.render(block.data(), block.size(), phase, increment, 0.5f, waveform);
+                        break;
+                    default:
+                        renderNaiveBlock(block.data(), block.size(), phase, increment, 0.5f, waveform);
+                }
+            };
+            
+            double snr[2];
+            for(int t = 0; t < 2; t++) {
+                // Exactly testBins[t] cycles per FFT frame
+                uint32_t increment = (uint32_t)(((uint64_t)testBins[t] << 32) / BENCH_FFT_SIZE);
+                uint32_t phase = 0;
+                std::vector<float> signal;
+                for(int b = -2; b < BENCH_FFT_SIZE / OSC_BLOCK_FRAMES; b++) { // Two blocks to settle the FIR
+                    render(phase, increment);
+                    phase += increment * OSC_BLOCK_FRAMES;
+                    if(b >= 0) signal.insert(signal.end(), block.begin(), block.end());
+                }
+                snr[t] = aliasingSnr(signal, testBins[t]);
+            }
+            
+            uint32_t increment = phaseIncrement(1000.0f, sampleRate);
+            uint32_t phase = 0;
+            volatile float sink = 0.0f;
+            auto start = std::chrono::steady_clock::now();
+            uint64_t startCycles = cycleCounter();
+            for(int b = 0; b < BENCH_BLOCKS; b++) {
+                render(phase, increment);
+                phase += increment * OSC_BLOCK_FRAMES;
+                sink = sink + block[b % OSC_BLOCK_FRAMES];
+            }
+            uint64_t cycles = cycleCounter() - startCycles;
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            double samples = (double)BENCH_BLOCKS * OSC_BLOCK_FRAMES;
+            
+            printf("%-9s %-10s %10.3f %14.2f %12.1f %12.1f\n", waveformNames[waveform], modeNames[mode],
+                   seconds * 1e9 / samples, cycles / samples, snr[0], snr[1]);
+        }
+    }
+    printf("cycles/sample counts TSC ticks (0 where no cycle counter is available)\n");
+    
+    // Full voice pool of saws spread over ~5 octaves
+    const int voiceBlocks = 2000;
+    std::vector<float> mix(OSC_BLOCK_FRAMES);
+    printf("\n%d saw voices, %d-frame blocks\n", MAX_VOICES, OSC_BLOCK_FRAMES);
+    printf("%-10s %16s %14s\n", "mode", "ns/voice-sample", "core load");
+    for(int mode = 0; mode < OSC_MODE_COUNT; mode++) {
+        VoicePool pool;
+        for(int v = 0; v < MAX_VOICES; v++) {
+            pool.noteOn(v, 55.0f * powf(2.0f, v / 48.0f), 1.0f / MAX_VOICES);
+        }
+        auto start = std::chrono::steady_clock::now();
+        for(int b = 0; b < voiceBlocks; b++) {
+            std::fill(mix.begin(), mix.end(), 0.0f);
+            renderVoices(pool, wavetables, mode, WAVE_SAW, mix.data(), block.data(), OSC_BLOCK_FRAMES);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double audioSeconds = (double)voiceBlocks * OSC_BLOCK_FRAMES / sampleRate;
+        printf("%-10s %16.3f %13.1f%%\n", oscModeNames[mode],
+               seconds * 1e9 / ((double)voiceBlocks * OSC_BLOCK_FRAMES * MAX_VOICES), 100.0 * seconds / audioSeconds);
+    }
+    
+    // Same pool split across the render workers; wall time per block against the budget
+    if(options.workers > 0) {
+        RenderPool renderPool;
+        renderPool.start(options.workers, options.spinMicroseconds);
+        printf("\n%d saw voices on the audio thread + %d workers\n", MAX_VOICES, renderPool.workerCount());
+        printf("%-10s %16s %14s\n", "mode", "us/block", "budget used");
+        for(int mode = 0; mode < OSC_MODE_COUNT; mode++) {
+            VoicePool pool;
+            for(int v = 0; v < MAX_VOICES; v++) {
+                pool.noteOn(v, 55.0f * powf(2.0f, v / 48.0f), 1.0f / MAX_VOICES);
+            }
+            double waitSeconds;
+            auto start = std::chrono::steady_clock::now();
+            for(int b = 0; b < voiceBlocks; b++) {
+                std::fill(mix.begin(), mix.end(), 0.0f);
+                renderPool.render(pool, wavetables, mode, WAVE_SAW, mix.data(), OSC_BLOCK_FRAMES, waitSeconds);
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            double budget = (double)OSC_BLOCK_FRAMES / sampleRate;
+            printf("%-10s %16.1f %13.1f%%\n", oscModeNames[mode], seconds * 1e6 / voiceBlocks,
+                   100.0 * seconds / voiceBlocks / budget);
+        }
+    }
+    
+    // Output stage: float stereo frames to each device format and layout
+    const unsigned long stageFrames = 512;
+    const int stageBlocks = 20000;
+    std::vector<float> frames(stageFrames * 2);
+    for(unsigned long i = 0; i < frames.size(); i++) frames[i] = 0.9f * sinf(i * 0.01f);
+    std::vector<uint8_t> device(stageFrames * 2 * sizeof(float));
+    void* runs[2] = {device.data(), device.data() + stageFrames * sizeof(float)};
+    printf("\nOutput conversion, stereo, %lu-frame buffers\n", stageFrames);
+    printf("%-8s %16s %16s\n", "format", "ns/frame", "non-interleaved");
+    for(int format = 0; format < FORMAT_COUNT; format++) {
+        double nsPerFrame[2];
+        for(int planar = 0; planar < 2; planar++) {
+            OutputStage stage;
+            stage.configure(format, planar != 0, 2, true);
+            auto start = std::chrono::steady_clock::now();
+            for(int b = 0; b < stageBlocks; b++) {
+                stage.write(frames.data(), planar ? (void*)runs : (void*)device.data(), 0, stageFrames);
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            nsPerFrame[planar] = seconds * 1e9 / ((double)stageBlocks * stageFrames);
+        }
+        printf("%-8s %16.3f %16.3f\n", sampleFormatNames[format], nsPerFrame[0], nsPerFrame[1]);
+    }
+    return 0;
+}
+
+// One line of an offline render script
+struct TimelineEvent {
+    double time;
+    std::string param;
+    float value;
+    int note;
+};
+
+static bool loadTimeline(const std::string& path, std::vector<TimelineEvent>& events) {
+    FILE* file = fopen(path.c_str(), "r");
+    if(!file) {
+        std::cerr << "Can't open timeline " << path << std::endl;
+        return false;
+    }
+    char line[256];
+    int lineNumber = 0;
+    bool ok = true;
+    while(ok && fgets(line, sizeof(line), file)) {
+        lineNumber++;
+        const char* text = line + strspn(line, " \t\r\n");
+        if(*text == '\0' || *text == '#') continue; // Blank line or comment
+        char param[32] = "", value[32] = "";
+        double time = 0.0;
+        int fields = sscanf(line, "%lf %31s %31s", &time, param, value);
+        
+        TimelineEvent event = {time, param, 0.0f, -1};
+        if(event.param == "waveform") {
+            event.value = (float)lookupName(waveformNames, WAVE_COUNT, value);
+        } else if(event.param == "mode") {
+            event.value = (float)lookupName(oscModeNames, OSC_MODE_COUNT, value);
+        } else if(event.param == "note_on" || event.param == "note_off") {
+            event.note = atoi(value);
+            event.value = 0.3f;
+            sscanf(line, "%*f %*s %*s %f", &event.value);
+        } else if(event.param == "frequency" || event.param == "phase" || event.param == "amplitude") {
+            event.value = (float)atof(value);
+        } else {
+            event.value = -1.0f;
+        }
+        if(fields < 3 || event.value < 0.0f) {
+            std::cerr << path << ":" << lineNumber << ": can't parse '" << line << "'" << std::endl;
+            ok = false;
+        }
+        events.push_back(event);
+    }
+    fclose(file);
+    std::stable_sort(events.begin(), events.end(),
+                     [](const TimelineEvent& a, const TimelineEvent& b) { return a.time < b.time; });
+    return ok;
+}
+
+// Offline render (--render): run the engine as fast as the CPU allows straight
+// into a WAV file. Timeline events are applied at their exact sample by
+// splitting the render at each event.
+#define OFFLINE_CHUNK_FRAMES 4096
+
+static int runOfflineRender(const Options& options) {
+    std::vector<TimelineEvent> timeline;
+    if(!options.timelinePath.empty() && !loadTimeline(options.timelinePath, timeline)) {
+        return -1;
+    }
+    
+    const double sampleRate = options.sampleRate;
+    std::unique_ptr<SawtoothData> data(new SawtoothData());
+    data->wavetables.build();
+    data->setSampleRate(sampleRate);
+    options.applySmoothing(*data);
+    RenderPool renderPool;
+    if(options.workers > 0) {
+        renderPool.start(options.workers, options.spinMicroseconds);
+        data->renderPool = &renderPool;
+    }
+    
+    DiskWriter disk;
+    WavWriter wav;
+    if(!disk.open(options.renderPath, false) || !wav.start((uint32_t)sampleRate, 2, disk)) {
+        std::cerr << disk.error << std::endl;
+        return -1;
+    }
+    
+    const uint64_t totalFrames = (uint64_t)llround(options.renderSeconds * sampleRate);
+    std::vector<float> buffer(OFFLINE_CHUNK_FRAMES * 2);
+    SawtoothParams params = data->current;
+    size_t nextEvent = 0;
+    uint64_t rendered = 0;
+    double renderSeconds = 0.0;
+    
+    while(rendered < totalFrames) {
+        // Queue everything due at this frame, untimed so the engine applies it
+        // at the start of the next render call
+        while(nextEvent < timeline.size() && (uint64_t)llround(timeline[nextEvent].time * sampleRate) <= rendered) {
+            const TimelineEvent& event = timeline[nextEvent];
+            SawtoothParams next = params;
+            if(event.param == "frequency") next.frequency = event.value;
+            else if(event.param == "phase") next.phaseOffset = event.value;
+            else if(event.param == "amplitude") next.amplitude = event.value;
+            else if(event.param == "waveform") next.waveform = (int)event.value;
+            else if(event.param == "mode") next.mode = (int)event.value;
+            bool isNote = event.param == "note_on" || event.param == "note_off";
+            bool queued = isNote ? data->notes.push({event.param == "note_on", event.note, event.value, 0.0})
+                                 : data->paramEvents.push({next, 0.0});
+            if(!queued) break; // Queue full: let the engine drain it before queueing more
+            params = next;
+            nextEvent++;
+        }
+        
+        uint64_t frames = std::min<uint64_t>(OFFLINE_CHUNK_FRAMES, totalFrames - rendered);
+        if(nextEvent < timeline.size()) {
+            uint64_t eventFrame = (uint64_t)llround(timeline[nextEvent].time * sampleRate);
+            frames = std::max<uint64_t>(1, std::min(frames, eventFrame - std::min(eventFrame, rendered)));
+        }
+        
+        auto start = std::chrono::steady_clock::now();
+        renderAudio(data.get(), buffer.data(), (unsigned long)frames, 0.0);
+        renderSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        
+        if(!wav.write(buffer.data(), (size_t)frames, disk)) {
+            std::cerr << "Write to " << options.renderPath << " failed: " << disk.error << std::endl;
+            return -1;
+        }
+        rendered += frames;
+    }
+    
+    uint8_t header[WAV_HEADER_BYTES];
+    wav.header(header);
+    if(!disk.finish(header, sizeof(header))) {
+        std::cerr << "Write to " << options.renderPath << " failed: " << disk.error << std::endl;
+        return -1;
+    }
+    
+    double audioSeconds = (double)rendered / sampleRate;
+    printf("Rendered %.2f s (%llu frames) to %s\n", audioSeconds, (unsigned long long)rendered,
+           options.renderPath.c_str());
+    printf("DSP time %.3f s: %.0f samples/s per channel, %.1fx real time\n", renderSeconds,
+           rendered / std::max(renderSeconds, 1e-9), audioSeconds / std::max(renderSeconds, 1e-9));
+    return 0;
+}
+
+// Tracker-style keyboard: the bottom letter row plays one octave from middle C
+static int noteForKey(SDL_Keycode key) {
+    static const SDL_Keycode keys[] = {SDLK_z, SDLK_s, SDLK_x, SDLK_d, SDLK_c, SDLK_v, SDLK_g,
+                                       SDLK_b, SDLK_h, SDLK_n, SDLK_j, SDLK_m, SDLK_COMMA};
+    for(int i = 0; i < (int)(sizeof(keys) / sizeof(keys[0])); i++) {
+        if(keys[i] == key) return 60 + i;
+    }
+    return -1;
 }
 
 std::atomic<int> handX(0), handY(0);
 std::atomic<bool> handPinch(false);
+std::atomic<double> handTime(0.0); // steadySeconds() when the last packet arrived
 
 void udpListener() {
     int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
@@ -273,13 +4330,26 @@ void udpListener() {
                 handX = x;
                 handY = y;
                 handPinch = (pinch == 1);
+                handTime = steadySeconds();
             }
         }
     }
     close(sockfd);
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    Options options;
+    if(!parseOptions(std::vector<std::string>(argv + 1, argv + argc), options)) {
+        printUsage(argv[0]);
+        return -1;
+    }
+    if(options.bench) {
+        return runOscillatorBenchmark(options);
+    }
+    if(!options.renderPath.empty()) {
+        return runOfflineRender(options);
+    }
+    
     // Initialize SDL
     if(SDL_Init(SDL_INIT_VIDEO) < 0) {
         std::cerr << "SDL init failed: " << SDL_GetError() << std::endl;
@@ -288,7 +4358,7 @@ int main() {
     
     SDL_Window* window = SDL_CreateWindow("Sawtooth Wave Generator with Controls",
                                          SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-                                         WINDOW_WIDTH, WINDOW_HEIGHT, SDL_WINDOW_SHOWN);
+                                         WINDOW_WIDTH, WINDOW_HEIGHT, SDL_WINDOW_SHOWN | SDL_WINDOW_ALLOW_HIGHDPI);
     
     if(!window) {
         std::cerr << "Window creation failed: " << SDL_GetError() << std::endl;
@@ -305,34 +4375,76 @@ int main() {
     }
     
     // Initialize audio
-    PaStream* stream;
-    PaError err;
     SawtoothData data;
+    data.wavetables.build();
+    options.applySmoothing(data);
     
-    err = Pa_Initialize();
-    if(err != paNoError) {
-        std::cerr << "PortAudio error: " << Pa_GetErrorText(err) << std::endl;
-        SDL_DestroyRenderer(renderer);
-        SDL_DestroyWindow(window);
-        SDL_Quit();
-        return -1;
+    RenderPool renderPool;
+    if(options.realtime) {
+        data.realtimeEnabled = true;
+        prepareRealtimeProcess(data.realtime, &data, sizeof(data));
+        prefaultMemory(&renderPool, sizeof(renderPool));
+    }
+    // Without SCHED_FIFO workers the callback could spin on a preempted one
+    if(options.workers > 0 && !options.realtime) {
+        std::cerr << "--workers needs real-time scheduling; rendering voices on the audio thread" << std::endl;
+    } else if(options.workers > 0) {
+        renderPool.start(options.workers, options.spinMicroseconds, &data.realtime);
+        data.renderPool = &renderPool;
     }
     
-    err = Pa_OpenDefaultStream(&stream, 0, 2, paFloat32, SAMPLE_RATE,
-                              FRAMES_PER_BUFFER, sawtoothCallback, &data);
-    
-    if(err != paNoError) {
-        std::cerr << "PortAudio error: " << Pa_GetErrorText(err) << std::endl;
-        Pa_Terminate();
+    std::unique_ptr<AudioBackend> audio(createAudioBackend(options.backend));
+    AudioBackendConfig audioConfig = {options.sampleRate, options.framesPerBuffer, 2, options.latency,
+                                      options.periods, options.device, options.nullOutput, options.format,
+                                      options.nonInterleaved, options.dither};
+    AdaptiveBuffer adaptive;
+    RenderAhead ahead;
+    if(options.adaptive) audioConfig.framesPerBuffer = ADAPTIVE_MIN_FRAMES;
+    if(!audio) {
+        std::cerr << "Unknown audio backend: " << options.backend << std::endl;
+    } else {
+        bool started = startAudio(*audio, audioConfig, data, ahead, options.renderAhead);
+        // Adaptive mode: the smallest buffer the device will take
+        while(!started && options.adaptive && audioConfig.framesPerBuffer < ADAPTIVE_MAX_FRAMES) {
+            audio->close();
+            audioConfig.framesPerBuffer *= 2;
+            started = startAudio(*audio, audioConfig, data, ahead, options.renderAhead);
+        }
+        if(!started) {
+            std::cerr << audio->error << std::endl;
+            audio.reset();
+        }
+    }
+    if(!audio) {
         SDL_DestroyRenderer(renderer);
         SDL_DestroyWindow(window);
         SDL_Quit();
         return -1;
     }
-    
-    Pa_StartStream(stream);
+    printAudioSettings(*audio);
+    Recorder recorder;
+    if(!options.recordPath.empty()) {
+        if(recorder.start(options.recordPath, audio->sampleRate, 2, options.recordDirect, options.recordThreads)) {
+            data.recorder.store(&recorder, std::memory_order_release);
+            std::cout << "Recording to " << options.recordPath << (recorder.disk.direct ? " (O_DIRECT)" : "") << std::endl;
+        } else {
+            std::cerr << recorder.disk.error << std::endl;
+        }
+    }
+    if(options.adaptive) {
+        adaptive.started(audio->framesPerBuffer, steadySeconds(), data.stats.outputUnderflows.load(std::memory_order_relaxed));
+    }
     
     // Create knobs
+    float renderScale = updateRenderScale(window, renderer);
+    BackgroundLayer background;
+    KnobSprites knobSprites;
+    ScopeTrace scopeTrace;
+    HandCursor handCursor;
+    TextBatch textBatch;
+    TextRun titleText;
+    titleText.layout("Sawtooth Wave Generator", 16, 17, {255, 255, 255, 255});
+    handCursor.trailLength = options.handTrail;
     std::vector<Knob> knobs;
     int knobY = WINDOW_HEIGHT - KNOB_PANEL_HEIGHT/2;
     
@@ -345,6 +4457,11 @@ int main() {
     std::cout << "- Frequency: 50-2000 Hz" << std::endl;
     std::cout << "- Phase: 0-1 (phase offset)" << std::endl;
     std::cout << "- Amplitude: 0-1 (volume)" << std::endl;
+    std::cout << "Press W to cycle saw/square/triangle, O to cycle naive/wavetable/polyblep oscillator" << std::endl;
+    if(ScopeTrace::thickAvailable()) {
+        std::cout << "Press T to toggle a thick antialiased scope trace" << std::endl;
+    }
+    std::cout << "Play extra voices on Z S X D C V G B H N J M , (one octave from middle C)" << std::endl;
     std::cout << "Press ESC or close window to exit" << std::endl;
     
     // Start UDP listener thread
@@ -356,8 +4473,24 @@ int main() {
     SDL_Event event;
     int mouseX = 0, mouseY = 0;
     bool mouseDown = false;
+    SawtoothParams published = data.current;
+    std::vector<NoteEvent> pendingNotes; // Key presses waiting for room in the note queue
+    int waveform = published.waveform;
+    int oscMode = published.mode;
+    Uint32 lastStatsUpdate = 0;
+    int realtimeReported = 0;
+    double lastHandTime = 0.0;
     
     while(running) {
+        // Gestures are stamped when they happened, on the audio backend's clock
+        const double frameSeconds = steadySeconds();
+        const double clockOffset = audio->time() - frameSeconds;
+        const Uint32 frameTicks = SDL_GetTicks();
+        auto sdlEventTime = [&](Uint32 timestamp) {
+            return frameSeconds - (Uint32)(frameTicks - timestamp) / 1000.0 + clockOffset;
+        };
+        double gestureTime = 0.0;
+        
         while(SDL_PollEvent(&event)) {
             if(event.type == SDL_QUIT) {
                 running = false;
@@ -367,6 +4500,44 @@ int main() {
                 running = false;
             }
             
+            // Moving to a display of another density, or losing the textures
+            if(event.type == SDL_WINDOWEVENT) {
+                renderScale = updateRenderScale(window, renderer);
+            }
+            if(event.type == SDL_RENDER_TARGETS_RESET) {
+                background.invalidate();
+            }
+            if(event.type == SDL_RENDER_DEVICE_RESET) {
+                knobSprites.release();
+                handCursor.release();
+                textBatch.release();
+                background.release();
+            }
+            
+            if(event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_w) {
+                waveform = (waveform + 1) % WAVE_COUNT;
+                gestureTime = sdlEventTime(event.key.timestamp);
+                std::cout << "Waveform: " << waveformNames[waveform] << std::endl;
+            }
+            
+            if(event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_t && ScopeTrace::thickAvailable()) {
+                scopeTrace.thick = !scopeTrace.thick;
+            }
+            
+            if(event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_o) {
+                oscMode = (oscMode + 1) % OSC_MODE_COUNT;
+                gestureTime = sdlEventTime(event.key.timestamp);
+                std::cout << "Oscillator mode: " << oscModeNames[oscMode] << std::endl;
+            }
+            
+            if((event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) && !event.key.repeat) {
+                int note = noteForKey(event.key.keysym.sym);
+                if(note >= 0) {
+                    pendingNotes.push_back({event.type == SDL_KEYDOWN, note, knobs[2].value * 0.5f,
+                                            sdlEventTime(event.key.timestamp)});
+                }
+            }
+            
             if(event.type == SDL_MOUSEBUTTONDOWN) {
                 if(event.button.button == SDL_BUTTON_LEFT) {
                     mouseDown = true;
@@ -385,72 +4556,148 @@ int main() {
             }
         }
         
+        // Queue notes in order. Whatever doesn't fit waits for the next frame
+        // rather than being dropped, so a note_off can't leave a voice stuck.
+        size_t notesSent = 0;
+        while(notesSent < pendingNotes.size() && data.notes.push(pendingNotes[notesSent])) notesSent++;
+        pendingNotes.erase(pendingNotes.begin(), pendingNotes.begin() + notesSent);
+        
         // Update knobs and sync with audio data
-        for(size_t i = 0; i < knobs.size(); i++) {
-            knobs[i].update(handX, handY, handPinch); // Use handPinch instead of mouseDown
-            
-            // Update audio parameters based on knob values
-            switch(i) {
-                case 0: // Frequency
-                    data.frequency = knobs[i].value;
-                    break;
-                case 1: // Phase
-                    data.phaseOffset = knobs[i].value;
-                    break;
-                case 2: // Amplitude
-                    data.amplitude = knobs[i].value;
-                    break;
-            }
+        for(auto& knob : knobs) {
+            knob.update(handX, handY, handPinch); // Use handPinch instead of mouseDown
+        }
+        double handStamp = handTime.load();
+        if(handStamp != lastHandTime) {
+            gestureTime = std::max(gestureTime, handStamp + clockOffset);
+            lastHandTime = handStamp;
         }
         
-        // Clear screen (black background)
-        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-        SDL_RenderClear(renderer);
-        
-        // Draw components
-        drawTitle(renderer);
-        drawGrid(renderer);
-        drawWaveform(renderer, data);
+        // Publish audio parameters based on knob values, timestamped so the
+        // engine applies them at the right sample. If the queue is full they
+        // stay unpublished and go out with the next frame, behind the events
+        // already queued, so an older change can never overwrite them.
+        SawtoothParams params = {knobs[0].value, knobs[1].value, knobs[2].value, waveform, oscMode};
+        if(params.frequency != published.frequency || params.phaseOffset != published.phaseOffset ||
+           params.amplitude != published.amplitude || params.waveform != published.waveform ||
+           params.mode != published.mode) {
+            if(gestureTime == 0.0) gestureTime = steadySeconds() + clockOffset;
+            if(data.paramEvents.push({params, gestureTime})) {
+                published = params;
+            }
+        }
         
-        // Draw control panel background
-        SDL_SetRenderDrawColor(renderer, 30, 30, 30, 255);
-        SDL_Rect controlPanel = {0, WINDOW_HEIGHT - KNOB_PANEL_HEIGHT, WINDOW_WIDTH, KNOB_PANEL_HEIGHT};
-        SDL_RenderFillRect(renderer, &controlPanel);
+        // Draw components. The scope is clipped to its area, which the
+        // control panel used to do by being drawn over it.
+        background.draw(renderer, renderScale);
+        SDL_Rect waveArea = {0, 0, WINDOW_WIDTH, WINDOW_HEIGHT - KNOB_PANEL_HEIGHT};
+        SDL_RenderSetClipRect(renderer, &waveArea);
+        drawWaveform(renderer, data, scopeTrace, renderScale);
+        SDL_RenderSetClipRect(renderer, nullptr);
         
-        // Draw knobs
+        // Draw knobs, then all the text in one go
+        knobSprites.prepare(renderer, renderScale);
+        textBatch.prepare(renderer, renderScale);
+        textBatch.add(titleText);
         for(auto& knob : knobs) {
-            knob.draw(renderer);
+            knob.draw(renderer, knobSprites, textBatch);
         }
+        textBatch.submit(renderer);
 
         // Draw hand position indicator (semi-transparent circle)
-        SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
-        if (handPinch) {
-            SDL_SetRenderDrawColor(renderer, 255, 80, 180, 120); // Pink, alpha=120/255
-        } else {
-            SDL_SetRenderDrawColor(renderer, 0, 200, 255, 100); // Cyan, alpha=100/255
-        }
-        int radius = 25;
-        for (int w = 0; w < radius * 2; w++) {
-            for (int h = 0; h < radius * 2; h++) {
-                int dx = radius - w;
-                int dy = radius - h;
-                if ((dx*dx + dy*dy) <= (radius * radius)) {
-                    SDL_RenderDrawPoint(renderer, handX + dx, handY + dy);
+        handCursor.prepare(renderer, renderScale);
+        handCursor.draw(renderer, handX, handY, handPinch);
+
+        SDL_RenderPresent(renderer);
+        
+        // Audio health in the title bar, once a second
+        Uint32 now = SDL_GetTicks();
+        if(now - lastStatsUpdate >= 1000) {
+            char title[192];
+            // In render-ahead mode the DSP load is the DSP thread's, not the callback's
+            bool renderingAhead = options.renderAhead > 0;
+            int length = snprintf(title, sizeof(title), "Sawtooth Wave Generator with Controls - DSP %.1f%% (peak %.1f%%), xruns %llu",
+                     100.0f * (renderingAhead ? ahead.lastLoad : data.stats.lastLoad).load(std::memory_order_relaxed),
+                     100.0f * (renderingAhead ? ahead.peakLoad : data.stats.peakLoad).load(std::memory_order_relaxed),
+                     (unsigned long long)(data.stats.outputUnderflows.load(std::memory_order_relaxed) +
+                                          ahead.shortfalls.load(std::memory_order_relaxed)));
+            if(data.recorder.load(std::memory_order_relaxed)) {
+                snprintf(title + length, sizeof(title) - length, ", recording%s, dropped %llu",
+                         recorder.failed.load(std::memory_order_relaxed) ? " FAILED" : "",
+                         (unsigned long long)recorder.droppedBlocks.load(std::memory_order_relaxed));
+            }
+            SDL_SetWindowTitle(window, title);
+            lastStatsUpdate = now;
+            
+            int setups = data.realtime.threadSetups.load(std::memory_order_acquire);
+            if(setups != realtimeReported) {
+                data.realtime.report(std::cout);
+                realtimeReported = setups;
+            }
+        }
+        
+        // Adaptive buffer sizing: the stream is reopened from here, never from the audio thread
+        if(options.adaptive) {
+            unsigned long frames = adaptive.update(steadySeconds(), data.stats.outputUnderflows.load(std::memory_order_relaxed));
+            if(frames) {
+                std::cout << (frames > adaptive.frames ? "Underflows, growing" : "Stable, shrinking")
+                          << " the buffer to " << frames << " frames" << std::endl;
+                unsigned long previous = audioConfig.framesPerBuffer;
+                stopAudio(*audio, ahead);
+                audioConfig.framesPerBuffer = frames;
+                bool started = startAudio(*audio, audioConfig, data, ahead, options.renderAhead);
+                if(!started) {
+                    std::cerr << audio->error << ", staying at " << previous << " frames" << std::endl;
+                    audio->close();
+                    audioConfig.framesPerBuffer = previous;
+                    started = startAudio(*audio, audioConfig, data, ahead, options.renderAhead);
+                }
+                if(!started) {
+                    std::cerr << audio->error << std::endl;
+                    running = false;
+                } else {
+                    printAudioSettings(*audio);
+                    adaptive.started(audio->framesPerBuffer, steadySeconds(),
+                                     data.stats.outputUnderflows.load(std::memory_order_relaxed));
                 }
             }
         }
-        SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
-
-        SDL_RenderPresent(renderer);
         
         SDL_Delay(16); // ~60 FPS
     }
     
     // Cleanup
-    Pa_StopStream(stream);
-    Pa_CloseStream(stream);
-    Pa_Terminate();
+    stopAudio(*audio, ahead);
+    if(data.recorder.exchange(nullptr)) {
+        bool recorded = recorder.stop();
+        std::cout << "Recorded " << recorder.seconds() << " s to " << recorder.path << " in " << recorder.disk.writes
+                  << " writes, peak ring fill " << 100.0 * recorder.peakFill.load() / recorder.ring.capacity
+                  << "%, dropped " << recorder.droppedBlocks.load() << " blocks (" << recorder.droppedFrames.load()
+                  << " frames)" << std::endl;
+        if(recorder.flacOutput) {
+            std::cout << "FLAC: " << 100.0 * recorder.compression() << "% of the float WAV size" << std::endl;
+        }
+        if(!recorded) std::cerr << "Recording incomplete: " << recorder.disk.error << std::endl;
+    }
+    
+    data.stats.dump(std::cout);
+    if(options.renderAhead > 0) {
+        std::cout << "Render-ahead: " << options.renderAhead << " blocks of " << ahead.blockFrames
+                  << " frames, peak DSP load " << 100.0f * ahead.peakLoad.load() << "%, FIFO shortfalls "
+                  << ahead.shortfalls.load() << std::endl;
+    }
+    if(renderPool.workerCount() > renderPool.fifoWorkers) {
+        std::cout << "Voice rendering stayed on the audio thread: only " << renderPool.fifoWorkers << " of "
+                  << renderPool.workerCount() << " workers got SCHED_FIFO" << std::endl;
+    }
+    renderPool.stop();
+    if(renderPool.fallbacks > 0) {
+        std::cout << "Voice rendering fell back to one thread " << renderPool.fallbacks << " times" << std::endl;
+    }
     
+    knobSprites.release();
+    handCursor.release();
+    textBatch.release();
+    background.release();
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
@@ -458,7 +4705,8 @@ int main() {
     return 0;
 }
 
-// Compilation (Linux):
-// g++ -o sawtooth_knobs sawtooth_knobs.cpp -lportaudio -lSDL2 -lm
+// Compilation (Linux), or use CMake; see README.md for the options:
+// g++ -std=c++17 -O2 -o WaveController main.cpp -lportaudio -lSDL2 -lpthread
+// With the ALSA backend: add -DWAVE_HAVE_ALSA and -lasound
 //
-// Install: sudo apt-get install libsdl2-dev portaudio19-dev
\ No newline at end of file
+// Install: sudo apt-get install libsdl2-dev portaudio19-dev libasound2-dev
\ No newline at end of file